@@ -0,0 +1,412 @@
+/**
+ * Microbenchmarks of the cache and command parser hot paths.
+ *
+ * Every benchmark reports time, heap allocations and system calls per
+ * operation. Time and allocations are measured in process, allocations by
+ * wrapping malloc(3) and friends. System calls are counted in a forked copy
+ * running the benchmark under ptrace(2), which would skew the timings.
+ *
+ * The cache is compiled in directly so its internal helpers can be measured.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "cache.c"
+#include "parse.h"
+
+
+#define MIN_NS          200000000   /* run every benchmark for 0.2 s */
+#define WARMUP_OPS      100
+#define TRACE_OPS       100         /* operations traced for syscall count */
+
+
+struct bench {
+    const char  *name;
+    void        (*setup) (void);
+    void        (*op) (void);
+    void        (*teardown) (void);
+};
+
+
+static const uint8_t    *key = (const uint8_t *) "localhost:22";
+static const uint8_t    payload[] = "0123456789abcdefghijklmnopqrst\r\n";
+static const uint8_t    cmds[] = "localhost:22\r\n127.0.0.1:22\r\n"
+                                 "localhost:9999\r\n127.0.0.1:9999\r\n";
+
+static int              sv[2];      /* socketpair for cache_sendfile */
+static pthread_t        drainer;
+
+static volatile uint8_t sink;       /* keeps results alive */
+
+static unsigned long    allocs;
+
+
+/*******************************************************************************
+ *
+ *  Heap allocation counting
+ *
+ ******************************************************************************/
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+    allocs++;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    allocs++;
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc (ptr, size);
+}
+
+
+/*******************************************************************************
+ *
+ *  Benchmarks
+ *
+ ******************************************************************************/
+
+static void
+op_compute_hash (void)
+{
+    uint8_t hash[HASHLEN + 1] = { 0 };
+
+    compute_hash (key, hash);
+    sink = hash[0];
+}
+
+
+static void
+op_cache_fpath (void)
+{
+    uint8_t hash[HASHLEN + 1] = { 0 };
+    uint8_t cache_file_path[PATH_MAXSIZ] = { 0 };
+
+    compute_hash (key, hash);
+    cache_fpath (hash, cache_file_path);
+    sink = cache_file_path[0];
+}
+
+
+static void
+setup_sync_none (void)
+{
+    cache_set_durability (CACHE_SYNC_NONE);
+}
+
+static void
+setup_sync_data (void)
+{
+    cache_set_durability (CACHE_SYNC_DATA);
+}
+
+static void
+setup_sync_full (void)
+{
+    cache_set_durability (CACHE_SYNC_FULL);
+}
+
+static void
+op_cache_write (void)
+{
+    if (cache_write (key, payload, sizeof (payload) - 1) < 0) {
+        err (1, "cache_write");
+    }
+}
+
+static void
+teardown_cache_write (void)
+{
+    uint8_t hash[HASHLEN + 1] = { 0 };
+    uint8_t cache_file_path[PATH_MAXSIZ] = { 0 };
+
+    compute_hash (key, hash);
+    cache_fpath (hash, cache_file_path);
+    unlink ((char *) cache_file_path);
+}
+
+
+/**
+ * Read everything sent to the socketpair, in a thread of its own so it is not
+ * traced along with the benchmark.
+ */
+static void *
+drain (void *arg)
+{
+    uint8_t buf[BUFSIZ];
+
+    (void) arg;
+    while (read (sv[1], buf, sizeof (buf)) > 0);
+
+    return NULL;
+}
+
+static void
+setup_cache_sendfile (void)
+{
+    setup_sync_none ();
+    op_cache_write ();
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        err (1, "socketpair");
+    }
+    if (pthread_create (&drainer, NULL, drain, NULL) != 0) {
+        errx (1, "pthread_create");
+    }
+}
+
+static void
+op_cache_sendfile (void)
+{
+    if (cache_sendfile (sv[0], key) <= 0) {
+        errx (1, "cache_sendfile");
+    }
+}
+
+static void
+teardown_cache_sendfile (void)
+{
+    close (sv[0]);
+    pthread_join (drainer, NULL);
+    close (sv[1]);
+    teardown_cache_write ();
+}
+
+
+static void
+op_extract_cmds (void)
+{
+    uint8_t buf[sizeof (cmds)];
+    uint8_t **services;
+
+    /* parsing is destructive */
+    memcpy (buf, cmds, sizeof (cmds));
+
+    services = extract_cmds (buf);
+    for (uint8_t **s = services; *s; ++s) {
+        sink = **s;
+        free (*s);
+    }
+    free (services);
+}
+
+
+static void
+op_extract_host_port (void)
+{
+    uint8_t remote_host[NI_MAXHOST],
+            remote_port[NI_MAXSERV];
+
+    remote_host[0] = remote_port[0] = '\0';
+    extract_host_port (key, strlen ((char *) key), remote_host, remote_port);
+    sink = remote_port[0];
+}
+
+
+static const struct bench benches[] = {
+    { "compute_hash",           NULL,   op_compute_hash,    NULL },
+    { "cache_fpath",            NULL,   op_cache_fpath,     NULL },
+    { "cache_write sync=none",  setup_sync_none,    op_cache_write,
+                                teardown_cache_write },
+    { "cache_write sync=data",  setup_sync_data,    op_cache_write,
+                                teardown_cache_write },
+    { "cache_write sync=full",  setup_sync_full,    op_cache_write,
+                                teardown_cache_write },
+    { "cache_sendfile",         setup_cache_sendfile,   op_cache_sendfile,
+                                teardown_cache_sendfile },
+    { "extract_cmds (4 cmds)",  NULL,   op_extract_cmds,    NULL },
+    { "extract_host_port",      NULL,   op_extract_host_port,   NULL },
+};
+
+
+/*******************************************************************************
+ *
+ *  Harness
+ *
+ ******************************************************************************/
+
+static uint64_t
+clock_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * Count system calls per operation by running TRACE_OPS operations in a
+ * traced child. Calls to getppid(2) mark the start and end of the
+ * operations. Returns -1 if tracing is not possible.
+ */
+static double
+count_syscalls (const struct bench *b)
+{
+    struct __ptrace_syscall_info    info;
+    pid_t                           pid;
+    int                             status,
+                                    marks = 0;
+    unsigned long                   count = 0;
+
+    if ((pid = fork ()) < 0) {
+        return -1;
+    } else if (pid == 0) {
+        if (ptrace (PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+            _exit (EXIT_FAILURE);
+        }
+        if (b->setup) {
+            b->setup ();
+        }
+
+        raise (SIGSTOP);
+        syscall (SYS_getppid);
+        for (int i = 0; i < TRACE_OPS; i++) {
+            b->op ();
+        }
+        syscall (SYS_getppid);
+
+        if (b->teardown) {
+            b->teardown ();
+        }
+        _exit (EXIT_SUCCESS);
+    }
+
+    if ((waitpid (pid, &status, 0) < 0) || !WIFSTOPPED (status)) {
+        return -1;
+    }
+    ptrace (PTRACE_SETOPTIONS, pid, NULL,
+            PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+    for (;;) {
+        if ((ptrace (PTRACE_SYSCALL, pid, NULL, NULL) < 0) ||
+            (waitpid (pid, &status, 0) < 0) || !WIFSTOPPED (status))
+        {
+            break;
+        }
+
+        if ((WSTOPSIG (status) != (SIGTRAP | 0x80)) ||
+            (ptrace (PTRACE_GET_SYSCALL_INFO, pid, sizeof (info), &info) <= 0) ||
+            (info.op != PTRACE_SYSCALL_INFO_ENTRY))
+        {
+            continue;
+        }
+
+        if (info.entry.nr == SYS_getppid) {
+            marks++;
+        } else if (marks == 1) {
+            count++;
+        }
+    }
+
+    waitpid (pid, &status, 0);
+
+    return marks >= 2 ? (double) count / TRACE_OPS : -1;
+}
+
+
+/**
+ * Run benchmark for at least MIN_NS and report per operation figures.
+ */
+static void
+run (const struct bench *b)
+{
+    uint64_t        start,
+                    elapsed = 0;
+    unsigned long   ops = 0,
+                    allocs_start;
+    double          syscalls;
+
+    if (b->setup) {
+        b->setup ();
+    }
+
+    for (int i = 0; i < WARMUP_OPS; i++) {
+        b->op ();
+    }
+
+    allocs_start = allocs;
+    start = clock_ns ();
+    for (unsigned long n = 1; elapsed < MIN_NS; n *= 2) {
+        for (unsigned long i = 0; i < n; i++) {
+            b->op ();
+        }
+        ops += n;
+        elapsed = clock_ns () - start;
+    }
+    allocs_start = allocs - allocs_start;
+
+    if (b->teardown) {
+        b->teardown ();
+    }
+
+    syscalls = count_syscalls (b);
+
+    printf ("%-24s %10lu %12.1f %10.2f ", b->name, ops,
+            (double) elapsed / ops, (double) allocs_start / ops);
+    if (syscalls < 0) {
+        printf ("%12s\n", "n/a");
+    } else {
+        printf ("%12.2f\n", syscalls);
+    }
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    char            basedir[] = "/tmp/ombud-bench.XXXXXX";
+    uint8_t         hash[HASHLEN + 1] = { 0 };
+    uint8_t         cache_dir_[PATH_MAXSIZ] = { 0 };
+
+    (void) argc;
+    (void) argv;
+
+    if (mkdtemp (basedir) == NULL) {
+        err (1, "mkdtemp");
+    }
+    if (cache_init ((const uint8_t *) basedir) < 0) {
+        err (1, "cache_init");
+    }
+
+    printf ("%-24s %10s %12s %10s %12s\n", "benchmark", "ops", "ns/op",
+            "allocs/op", "syscalls/op");
+    fflush (stdout);
+
+    for (size_t i = 0; i < sizeof (benches) / sizeof (benches[0]); i++) {
+        run (&benches[i]);
+        fflush (stdout);
+    }
+
+    /* remove what the cache benchmarks left behind */
+    compute_hash (key, hash);
+    cache_dir (hash, cache_dir_);
+    rmdir ((char *) cache_dir_);
+    snprintf ((char *) cache_dir_, sizeof (cache_dir_), "%s/" CACHE_SECRET,
+              basedir);
+    unlink ((char *) cache_dir_);
+    rmdir (basedir);
+
+    return EXIT_SUCCESS;
+}
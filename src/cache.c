@@ -4,7 +4,17 @@
  * Keys are composed of "addr:port" combinations. Contents are cached on
  * filesystem where the first two characters of the key hash is a directory
  * and the remaining key hash is the filename. This creates a simple, yet
- * efficient, load balancing.
+ * efficient, load balancing. The key hash is keyed with a random secret kept
+ * in the cache directory, so no one can pick keys that collide on an entry.
+ *
+ * With deduplication, contents are stored once as blobs named by the hash of
+ * the contents under CACHE_BLOBDIR, with the same two level layout, and keys
+ * are hard links to the blobs. The link count of a blob is its reference
+ * count: a blob with a link count of one is referenced by no key and removed.
+ * As keys share the modification time of their blob, the freshness of each
+ * key is kept in an empty stamp file next to it instead. Entries may outlive
+ * a restart without deduplication, so blobs are released and stamps used
+ * whenever an entry is a link, whether deduplication is on or not.
  */
 
 #include "cache.h"
@@ -12,6 +22,19 @@
 
 static uint8_t cache_basedir[PATH_MAXSIZ] = { 0 };
 
+/* key of the key hash, see cache_secret() */
+static uint64_t cache_k0 = 0,
+                cache_k1 = 0;
+
+/* entries older than this are refreshed in the background, 0 never */
+static time_t cache_soft_ttl = 0;
+
+/* how hard cache_write() pushes contents to disk */
+static int cache_durability = CACHE_SYNC_FULL;
+
+/* store identical contents once */
+static int cache_dedup = 0;
+
 
 /*******************************************************************************
  *
@@ -21,20 +44,22 @@ static uint8_t cache_basedir[PATH_MAXSIZ] = { 0 };
 
 /**
  * Calculate hash based on "addr:port"
+ *
+ * Keys are short and looked up for every command. Keys that hash the same
+ * share an entry, so the hash is keyed: without the secret no one can pick
+ * a key that collides with, and poisons, the entry of another.
  */
 static void
 compute_hash (const uint8_t * key, uint8_t * hash)
 {
-    uint8_t tmphash[SHA_DIGEST_LENGTH] = { 0 };
-
-    /* hash "addr:port" as cache key */
-    SHA1 ((unsigned char *) key,
-          strlen ((char *) key),
-          (unsigned char *) tmphash);
-
-    /* reformat to hexadecimal */
-    for (uint8_t i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sprintf ((char *) &(hash[i * 2]), "%02x", tmphash[i]);
+    static const uint8_t hex[] = "0123456789abcdef";
+    uint64_t h = hash64_keyed (key, strlen ((char *) key),
+                               cache_k0, cache_k1);
+
+    /* reformat to hexadecimal, most significant digit first */
+    for (int i = HASHLEN - 1; i >= 0; i--) {
+        hash[i] = hex[h & 0xf];
+        h >>= 4;
     }
 }
 
@@ -67,11 +92,270 @@ cache_fpath (const uint8_t * hash, uint8_t * cache_file_path)
     strncat ((char *) cache_file_path, (char *) cache_dir_,
              strlen ((char *) cache_dir_));
     strncat ((char *) cache_file_path, "/", 2);
-    /* last 18 hex digits are the file name */
+    /* remaining hex digits are the file name */
     strncat ((char *) cache_file_path, (char *) hash + 2, HASHLEN - 2);
 }
 
 
+/**
+ * Format path of the stamp file of cache file "cache_file_path".
+ */
+static int
+stamp_fpath (const uint8_t * cache_file_path, uint8_t * stamp_file_path)
+{
+    if (snprintf ((char *) stamp_file_path, PATH_MAXSIZ, "%s" CACHE_STAMPEXT,
+                  (char *) cache_file_path) >= PATH_MAXSIZ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Mark the entry at "cache_file_path" as fresh as of now.
+ */
+static int
+stamp_touch (const uint8_t * cache_file_path)
+{
+    uint8_t stamp_file_path[PATH_MAXSIZ] = { 0 };
+    int     fp;
+
+    if (stamp_fpath (cache_file_path, stamp_file_path) < 0) {
+        return -1;
+    }
+
+    if (utimensat (AT_FDCWD, (char *) stamp_file_path, NULL, 0) == 0) {
+        return 0;
+    }
+    if ((errno != ENOENT) ||
+        ((fp = open ((char *) stamp_file_path, O_WRONLY | O_CREAT,
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)) {
+        return -1;
+    }
+    close (fp);
+
+    return 0;
+}
+
+
+/**
+ * Format blob file path and directory of contents "buf".
+ */
+static int
+blob_fpath (const uint8_t * buf, const size_t buflen, uint8_t * blob_dir,
+            uint8_t * blob_file_path)
+{
+    uint8_t tmphash[SHA_DIGEST_LENGTH] = { 0 };
+    uint8_t hash[SHA_DIGEST_LENGTH * 2 + 1] = { 0 };
+
+    /* contents are shared on a match, so use a strong hash */
+    SHA1 ((unsigned char *) buf, buflen, (unsigned char *) tmphash);
+    for (uint8_t i = 0; i < SHA_DIGEST_LENGTH; i++) {
+        sprintf ((char *) &(hash[i * 2]), "%02x", tmphash[i]);
+    }
+
+    if ((snprintf ((char *) blob_dir, PATH_MAXSIZ, "%s/" CACHE_BLOBDIR "/%.2s",
+                   (char *) cache_basedir, (char *) hash) >= PATH_MAXSIZ) ||
+        (snprintf ((char *) blob_file_path, PATH_MAXSIZ, "%s/%s",
+                   (char *) blob_dir, (char *) hash + 2) >= PATH_MAXSIZ))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Write contents to a new file at "path", synced as far as asked to.
+ */
+static int
+write_file (const uint8_t * path, const uint8_t * buf, const ssize_t buflen)
+{
+    int fp;
+
+    if ((fp = open ((char *) path,
+                    O_WRONLY | O_CREAT | O_TRUNC,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        return -1;
+    }
+    if (write (fp, buf, buflen) != buflen) {
+        close (fp);
+        unlink ((char *) path);
+        return -1;
+    }
+    /* ensure everything is flushed to disk, as far as asked to */
+    if (cache_durability == CACHE_SYNC_FULL) {
+        fsync (fp);
+    } else if (cache_durability == CACHE_SYNC_DATA) {
+        fdatasync (fp);
+    }
+    close (fp);
+
+    return 0;
+}
+
+
+/**
+ * Link "tmp_file_path" to the blob of contents "buf", storing the contents
+ * as a new blob if there is none yet.
+ *
+ * Returns 1 if "old", the contents replaced, already is that blob and there
+ * is nothing to do.
+ */
+static int
+blob_link (const uint8_t * buf, const ssize_t buflen,
+           const uint8_t * tmp_file_path, const struct stat * old)
+{
+    uint8_t     blob_dir[PATH_MAXSIZ] = { 0 };
+    uint8_t     blob_file_path[PATH_MAXSIZ] = { 0 };
+    struct stat st;
+
+    if (blob_fpath (buf, buflen, blob_dir, blob_file_path) < 0) {
+        return -1;
+    }
+
+    if (stat ((char *) blob_file_path, &st) == 0) {
+        if (old && (old->st_dev == st.st_dev) && (old->st_ino == st.st_ino)) {
+            /* unchanged */
+            return 1;
+        }
+
+        if (link ((char *) blob_file_path, (char *) tmp_file_path) == 0) {
+            return 0;
+        }
+        /* blob released meanwhile, store it again */
+    }
+
+    if (write_file (tmp_file_path, buf, buflen) < 0) {
+        return -1;
+    }
+
+    /* publish as blob, losing a race to another writer only costs space */
+    if (mkdir ((char *) blob_dir, 0777) != 0 && errno == ENOENT) {
+        uint8_t blobs[PATH_MAXSIZ] = { 0 };
+
+        /* first blob, the blob dir is a prefix of a path that fitted */
+        memcpy (blobs, blob_dir, strlen ((char *) blob_dir) - 3);
+        mkdir ((char *) blobs, 0777);
+        mkdir ((char *) blob_dir, 0777);
+    }
+    link ((char *) tmp_file_path, (char *) blob_file_path);
+
+    return 0;
+}
+
+
+/**
+ * Drop the reference of replaced contents "fd" to their blob, and remove the
+ * blob when nothing else references it.
+ */
+static void
+blob_release (const int fd)
+{
+    uint8_t     blob_dir[PATH_MAXSIZ] = { 0 };
+    uint8_t     blob_file_path[PATH_MAXSIZ] = { 0 };
+    uint8_t     *buf;
+    struct stat st,
+                blob_st;
+
+    /* only the blob itself is left */
+    if ((fstat (fd, &st) < 0) || (st.st_nlink != 1)) {
+        return;
+    }
+
+    if ((buf = malloc (st.st_size + 1)) == NULL) {
+        return;
+    }
+
+    if ((pread (fd, buf, st.st_size, 0) == st.st_size) &&
+        (blob_fpath (buf, st.st_size, blob_dir, blob_file_path) == 0)) {
+        /* make sure it is the blob, not contents stored without dedup */
+        if ((stat ((char *) blob_file_path, &blob_st) == 0) &&
+            (blob_st.st_dev == st.st_dev) && (blob_st.st_ino == st.st_ino))
+        {
+            unlink ((char *) blob_file_path);
+        }
+    }
+
+    free (buf);
+}
+
+
+/**
+ * Load the secret key of the key hash from the cache directory, generating
+ * it on first use. It is kept so that entries are found again after a
+ * restart.
+ */
+static int
+cache_secret (void)
+{
+    uint8_t secret_file_path[PATH_MAXSIZ] = { 0 };
+    uint8_t tmp_file_path[PATH_MAXSIZ + 16] = { 0 };
+    uint8_t secret[16];
+    ssize_t r;
+    int     fp;
+
+    if (snprintf ((char *) secret_file_path, PATH_MAXSIZ, "%s/" CACHE_SECRET,
+                  (char *) cache_basedir) >= PATH_MAXSIZ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fp = open ((char *) secret_file_path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            return -1;
+        }
+
+        /* publish a complete secret only, the first one linked wins */
+        snprintf ((char *) tmp_file_path, sizeof (tmp_file_path), "%s.%d",
+                  (char *) secret_file_path, getpid ());
+        if (getrandom (secret, sizeof (secret), 0) != sizeof (secret)) {
+            return -1;
+        }
+        if ((fp = open ((char *) tmp_file_path,
+                        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+            return -1;
+        }
+        r = write (fp, secret, sizeof (secret));
+        if ((r != sizeof (secret)) || (fsync (fp) < 0)) {
+            close (fp);
+            unlink ((char *) tmp_file_path);
+            return -1;
+        }
+        close (fp);
+        if ((link ((char *) tmp_file_path, (char *) secret_file_path) < 0) &&
+            (errno != EEXIST)) {
+            unlink ((char *) tmp_file_path);
+            return -1;
+        }
+        unlink ((char *) tmp_file_path);
+
+        if ((fp = open ((char *) secret_file_path, O_RDONLY)) < 0) {
+            return -1;
+        }
+    }
+
+    r = read (fp, secret, sizeof (secret));
+    close (fp);
+    if (r != sizeof (secret)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cache_k0 = cache_k1 = 0;
+    for (int i = 0; i < 8; i++) {
+        cache_k0 |= (uint64_t) secret[i] << (8 * i);
+        cache_k1 |= (uint64_t) secret[8 + i] << (8 * i);
+    }
+
+    return 0;
+}
+
+
 /*******************************************************************************
  *
  *  API
@@ -81,7 +365,8 @@ cache_fpath (const uint8_t * hash, uint8_t * cache_file_path)
 /**
  * Initialize the cache.
  *
- * Create cache directory if it does not already exist.
+ * Create cache directory if it does not already exist, and load or create
+ * the secret of the key hash in it.
  *
  * Note this is not handling nestling of directories, i.e. mkdir -p.
  */
@@ -105,12 +390,54 @@ cache_init (const uint8_t * cache_basedir_input)
         status = -1;
     }
 
+    if ((status == 0) && (cache_secret () < 0)) {
+        status = -1;
+    }
+
     return status;
 }
 
 
+/**
+ * Set the soft time to live of cache entries in seconds, 0 disables it.
+ *
+ * Entries older than this are still served, but cache_open() asks for them
+ * to be refreshed.
+ */
+void
+cache_set_soft_ttl (const time_t soft_ttl)
+{
+    cache_soft_ttl = soft_ttl;
+}
+
+
+/**
+ * Set how cache_write() syncs contents to disk, one of CACHE_SYNC_NONE,
+ * CACHE_SYNC_DATA or CACHE_SYNC_FULL.
+ */
+void
+cache_set_durability (const int durability)
+{
+    cache_durability = durability;
+}
+
+
+/**
+ * Store identical contents only once, see blob_link().
+ */
+void
+cache_set_dedup (const int dedup)
+{
+    cache_dedup = dedup;
+}
+
+
 /**
  * Store buf in cache at key.
+ *
+ * The contents are written to a temporary file which is renamed over the
+ * entry, so readers see either the old or the new contents, never a mix.
+ * With deduplication the temporary file is a link to the blob instead.
  */
 int
 cache_write (const uint8_t * key, const uint8_t * buf, const ssize_t buflen)
@@ -118,7 +445,10 @@ cache_write (const uint8_t * key, const uint8_t * buf, const ssize_t buflen)
     uint8_t hash[HASHLEN] = { 0 };
     uint8_t cache_dir_[PATH_MAXSIZ] = { 0 };
     uint8_t cache_file_path[PATH_MAXSIZ] = { 0 };
-    int fp;
+    uint8_t tmp_file_path[PATH_MAXSIZ + 16] = { 0 };
+    struct stat st;
+    int old = -1,
+        r;
 
     compute_hash (key, hash);
     cache_dir (hash, cache_dir_);
@@ -129,57 +459,169 @@ cache_write (const uint8_t * key, const uint8_t * buf, const ssize_t buflen)
         return -1;
     }
 
-    /* create cache file and store contents */
-    fp = open ((char *) cache_file_path,
-               O_WRONLY | O_CREAT,
-               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    write (fp, buf, buflen);
-    fsync (fp); // ensure everything is flushed to disk
-    close (fp);
+    /* temporary file is private to this process */
+    snprintf ((char *) tmp_file_path, sizeof (tmp_file_path), "%s.%d",
+              (char *) cache_file_path, getpid ());
+
+    /* hold on to replaced contents to release their blob */
+    if (((old = open ((char *) cache_file_path, O_RDONLY)) >= 0) &&
+        (fstat (old, &st) < 0)) {
+        close (old);
+        old = -1;
+    }
+
+    if (!cache_dedup) {
+        /* create cache file and store contents */
+        if (write_file (tmp_file_path, buf, buflen) < 0) {
+            if (old >= 0) {
+                close (old);
+            }
+            return -1;
+        }
+    } else {
+        if ((r = blob_link (buf, buflen, tmp_file_path,
+                            old >= 0 ? &st : NULL)) != 0) {
+            if (old >= 0) {
+                close (old);
+            }
+            if (r < 0) {
+                return -1;
+            }
+            /* unchanged contents, but fresh again */
+            stamp_touch (cache_file_path);
+            return 0;
+        }
+    }
+
+    /* atomically replace previous contents */
+    if (rename ((char *) tmp_file_path, (char *) cache_file_path) != 0) {
+        unlink ((char *) tmp_file_path);
+        if (old >= 0) {
+            close (old);
+        }
+        return -1;
+    }
+
+    if (old >= 0) {
+        blob_release (old);
+        close (old);
+    }
+    if (cache_dedup) {
+        stamp_touch (cache_file_path);
+    }
 
     return 0;
 }
 
 
 /**
- * Send cache contents at "key" to supplied socket "socket".
+ * Open cache contents at "key" for reading.
  *
- * This uses sendfile(2) which shuffles all the data from file to socket in
- * kernel space.
+ * Returns a file descriptor and stores the content size in "fsize", or -1 on
+ * a cache miss.
+ *
+ * If "stale" is given it is set when the entry is past its soft time to live
+ * and the caller should refresh it. The entry is then touched so that only
+ * one caller, in any process, is asked to refresh it per time to live. An
+ * entry linked to a blob uses its stamp file instead, and is stale without
+ * one.
  */
-ssize_t
-cache_sendfile (const int socket, const uint8_t * key)
+int
+cache_open (const uint8_t * key, size_t * fsize, int * stale)
 {
     uint8_t     hash[HASHLEN] = { 0 };
     uint8_t     cache_file_path[PATH_MAXSIZ] = { 0 };
-    FILE        *fp;
-    size_t      fsize;
-    ssize_t     sentbytes = 0;
+    uint8_t     stamp_file_path[PATH_MAXSIZ] = { 0 };
+    struct stat st,
+                stamp_st;
+    int         fd;
 
     compute_hash (key, hash);
     cache_fpath (hash, cache_file_path);
 
-    /* calculate cache content size */
-    if ((fp = fopen ((char *) cache_file_path, "r")) == NULL) {
+    if ((fd = open ((char *) cache_file_path, O_RDONLY)) < 0) {
         /* cache miss */
-        return 0;
+        return -1;
+    }
+
+    /* cache hit, calculate cache content size */
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        return -1;
+    }
+    *fsize = st.st_size;
+
+    if (stale && (st.st_nlink == 1)) {
+        *stale = cache_soft_ttl &&
+                 (time (NULL) - st.st_mtime >= cache_soft_ttl) &&
+                 (futimens (fd, NULL) == 0);
+    } else if (stale) {
+        /* contents are shared, their own mtime is not of this key */
+        if ((stamp_fpath (cache_file_path, stamp_file_path) < 0) ||
+            (stat ((char *) stamp_file_path, &stamp_st) < 0)) {
+            stamp_st.st_mtime = 0;
+        }
+        *stale = cache_soft_ttl &&
+                 (time (NULL) - stamp_st.st_mtime >= cache_soft_ttl) &&
+                 (stamp_touch (cache_file_path) == 0);
     }
 
-    /* cache hit, send to supplied socket */
+    return fd;
+}
 
-    /* calculate cache file size */
-    fseek (fp, 0, SEEK_END);
-    fsize = ftell (fp);
-    fclose (fp);
 
-    int fd = open ((char *) cache_file_path, O_RDONLY);
+/**
+ * Send "fsize" bytes of opened cache contents "fd" to supplied socket
+ * "socket".
+ *
+ * This uses sendfile(2) which shuffles all the data from file to socket in
+ * kernel space. Sending continues from the file position of "fd".
+ *
+ * Returns number of bytes sent, which is short of "fsize" when a
+ * non-blocking socket would block or the file is shorter, or -1 on error.
+ */
+ssize_t
+cache_sendfd (const int socket, const int fd, const size_t fsize)
+{
+    ssize_t     sentbytes = 0,
+                numbytes;
+
     while (sentbytes < (ssize_t) fsize) {
-        if ((sentbytes = sendfile (socket, fd, NULL, fsize)) == -1) {
+        if ((numbytes = sendfile (socket, fd, NULL, fsize - sentbytes)) < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
             perror ("could not send from cache");
+            return -1;
+        } else if (numbytes == 0) {
+            /* file truncated */
             break;
         }
+        sentbytes += numbytes;
+    }
+
+    return sentbytes;
+}
+
+
+/**
+ * Send cache contents at "key" to supplied socket "socket".
+ *
+ * Returns number of bytes sent, 0 on a cache miss or -1 on error.
+ */
+ssize_t
+cache_sendfile (const int socket, const uint8_t * key)
+{
+    size_t      fsize;
+    ssize_t     sentbytes;
+    int         fd;
+
+    if ((fd = cache_open (key, &fsize, NULL)) < 0) {
+        /* cache miss */
+        return 0;
     }
 
+    sentbytes = cache_sendfd (socket, fd, fsize);
     close (fd);
 
     return sentbytes;
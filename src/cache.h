@@ -5,20 +5,45 @@
 #include <openssl/sha.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "hash.h"
 
-#define HASHLEN     SHA_DIGEST_LENGTH * 2
+
+#define HASHLEN     (sizeof (uint64_t) * 2)     /* hex digits of key hash */
 #define PATH_MAXSIZ 1024
 
+#define CACHE_BLOBDIR   "blobs"     /* deduplicated contents, in base dir */
+#define CACHE_STAMPEXT  ".stamp"    /* freshness of deduplicated entries */
+#define CACHE_SECRET    "secret"    /* key of the key hash, in base dir */
+
+/* cache_write() durability */
+#define CACHE_SYNC_NONE     0   /* leave it to the page cache */
+#define CACHE_SYNC_DATA     1   /* fdatasync(2) */
+#define CACHE_SYNC_FULL     2   /* fsync(2) */
+
 
 extern int cache_init (const uint8_t * cache_basedir);
 
+extern void cache_set_soft_ttl (const time_t soft_ttl);
+
+extern void cache_set_durability (const int durability);
+
+extern void cache_set_dedup (const int dedup);
+
 extern int cache_write (const uint8_t * key, const uint8_t * buf,
                         const ssize_t buflen);
 
+extern int cache_open (const uint8_t * key, size_t * fsize, int * stale);
+
+extern ssize_t cache_sendfd (const int socket, const int fd,
+                             const size_t fsize);
+
 extern ssize_t cache_sendfile (const int socket, const uint8_t * key);
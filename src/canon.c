@@ -0,0 +1,151 @@
+/**
+ * Canonical cache keys.
+ *
+ * Clients may name the same service in many ways, "localhost:22",
+ * "LOCALHOST:ssh" and "127.0.0.1:22" are all the same. Keys are rewritten
+ * to one form so the service is cached, and fetched, only once.
+ *
+ * Looking up service names and resolving hosts blocks, so results are
+ * remembered for CANON_TTL seconds in a small direct mapped table. The table
+ * is per process, like everything else in a worker.
+ */
+
+#include "canon.h"
+
+
+struct memo {
+    uint8_t     *key;       /* service as given */
+    uint8_t     *canon;     /* its canonical form */
+    int         mode;
+    time_t      expires;
+};
+
+static struct memo memo[CANON_MEMO];
+
+
+/*******************************************************************************
+ *
+ *  Internal helper functions
+ *
+ ******************************************************************************/
+
+/**
+ * Rewrite "port" as a number, looking up service names. Returns -1 for
+ * unknown services.
+ */
+static int
+canon_port (uint8_t * port)
+{
+    struct servent  *se;
+    uint8_t         *p;
+
+    for (p = port; isdigit (*p); p++);
+
+    if (*port && !*p) {
+        /* numeric already, drop leading zeros */
+        snprintf ((char *) port, NI_MAXSERV, "%d", atoi ((char *) port));
+        return 0;
+    }
+
+    if ((se = getservbyname ((char *) port, "tcp")) == NULL) {
+        return -1;
+    }
+    snprintf ((char *) port, NI_MAXSERV, "%d", ntohs (se->s_port));
+
+    return 0;
+}
+
+
+/**
+ * Rewrite "host" as its first IPv4 address, the one connected to.
+ */
+static int
+canon_addr (uint8_t * host)
+{
+    struct addrinfo     hints,
+                        *info;
+
+    bzero (&hints, sizeof (struct addrinfo));
+    hints.ai_family   = AF_INET;        /* IPv4 */
+    hints.ai_socktype = SOCK_STREAM;    /* TCP */
+
+    if (getaddrinfo ((char *) host, NULL, &hints, &info) != 0) {
+        return -1;
+    }
+
+    inet_ntop (AF_INET, &((struct sockaddr_in *) info->ai_addr)->sin_addr,
+               (char *) host, NI_MAXHOST);
+    freeaddrinfo (info);
+
+    return 0;
+}
+
+
+/*******************************************************************************
+ *
+ *  API
+ *
+ ******************************************************************************/
+
+/**
+ * Canonical form of "service" according to "mode", CANON_NAME or
+ * CANON_ADDR.
+ *
+ * Returns a newly allocated string, or NULL if the service is malformed or
+ * names an unknown port, in which case it should be used as is. A host that
+ * can not be resolved keeps its name.
+ */
+uint8_t *
+canon_key (const uint8_t * service, const int mode)
+{
+    uint8_t         host[NI_MAXHOST] = { 0 },
+                    port[NI_MAXSERV] = { 0 },
+                    canon[SERVMAXLEN];
+    size_t          len = strlen ((char *) service),
+                    hostlen;
+    struct memo     *m = &memo[hash64 (service, len) & (CANON_MEMO - 1)];
+    time_t          now = time (NULL);
+    const char      *colon;
+
+    if ((m->key != NULL) && (m->mode == mode) && (now < m->expires) &&
+        !strcmp ((char *) m->key, (char *) service))
+    {
+        return (uint8_t *) strdup ((char *) m->canon);
+    }
+
+    /* host and port have to fit */
+    colon = strrchr ((char *) service, ':');
+    if ((colon == NULL) || (colon - (char *) service >= NI_MAXHOST) ||
+        (strlen (colon + 1) >= NI_MAXSERV) ||
+        (extract_host_port (service, len, host, port) < 0) ||
+        (canon_port (port) < 0))
+    {
+        return NULL;
+    }
+
+    /* host names are case insensitive and may be fully qualified */
+    for (uint8_t *h = host; *h; h++) {
+        *h = tolower (*h);
+    }
+    hostlen = strlen ((char *) host);
+    if (hostlen > 1 && host[hostlen - 1] == '.') {
+        host[hostlen - 1] = '\0';
+    }
+
+    if (mode == CANON_ADDR) {
+        canon_addr (host);
+    }
+
+    snprintf ((char *) canon, sizeof (canon), "%s:%s",
+              (char *) host, (char *) port);
+
+    /* remember, replacing whatever was there */
+    free (m->key);
+    free (m->canon);
+    m->key = (uint8_t *) strdup ((char *) service);
+    m->canon = (uint8_t *) strdup ((char *) canon);
+    m->mode = mode;
+    m->expires = now + CANON_TTL;
+
+    return (uint8_t *) strdup ((char *) canon);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "hash.h"
+#include "parse.h"
+
+
+/* how far cache keys are canonicalized */
+#define CANON_NONE      0   /* as sent by the client */
+#define CANON_NAME      1   /* lower case host, numeric port */
+#define CANON_ADDR      2   /* IPv4 address, numeric port */
+
+#define CANON_MEMO      256     /* remembered keys per process, power of 2 */
+#define CANON_TTL       60      /* seconds a remembered key is used */
+
+
+extern uint8_t * canon_key (const uint8_t * service, const int mode);
@@ -0,0 +1,93 @@
+/**
+ * Length framed binary protocol.
+ *
+ * A client switches its connection to framed mode by sending the line
+ * "FRAMED\r\n", which is answered with an empty FRAME_OK response. From then
+ * on every request is
+ *
+ *      id (uint32) | key length (uint16) | key ("addr:port")
+ *
+ * and every response is
+ *
+ *      id (uint32) | status (uint8) | payload length (uint32) | payload
+ *
+ * with integers in network byte order. Responses carry the id of their
+ * request but may arrive in any order, cache hits are usually answered before
+ * misses sent earlier.
+ */
+
+#include "frame.h"
+
+
+/**
+ * Check if buf starts with the framed mode hello line.
+ *
+ * Returns the length of the line including newline, 0 if it is not there.
+ */
+size_t
+frame_hello (const uint8_t * buf, const size_t len)
+{
+    size_t hellolen = strlen (FRAME_HELLO);
+
+    if ((len <= hellolen) || memcmp (buf, FRAME_HELLO, hellolen)) {
+        return 0;
+    }
+
+    /* allow \n as well as \r\n */
+    if (buf[hellolen] == '\n') {
+        return hellolen + 1;
+    } else if ((len > hellolen + 1) &&
+               (buf[hellolen] == '\r') && (buf[hellolen + 1] == '\n')) {
+        return hellolen + 2;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Parse one request frame from buf.
+ *
+ * Returns the number of bytes the frame occupies, 0 if buf does not hold a
+ * complete frame yet. The key points into buf and is not terminated.
+ */
+ssize_t
+frame_parse (const uint8_t * buf, const size_t len, uint32_t * id,
+             const uint8_t ** key, size_t * keylen)
+{
+    uint32_t    nid;
+    uint16_t    nkeylen;
+
+    if (len < FRAME_REQ_HDRLEN) {
+        return 0;
+    }
+
+    memcpy (&nid, buf, sizeof (nid));
+    memcpy (&nkeylen, buf + sizeof (nid), sizeof (nkeylen));
+
+    *id = ntohl (nid);
+    *keylen = ntohs (nkeylen);
+    *key = buf + FRAME_REQ_HDRLEN;
+
+    if (len < FRAME_REQ_HDRLEN + *keylen) {
+        return 0;
+    }
+
+    return FRAME_REQ_HDRLEN + *keylen;
+}
+
+
+/**
+ * Format response header into hdr, which holds FRAME_RESP_HDRLEN bytes.
+ */
+void
+frame_header (uint8_t * hdr, const uint32_t id, const uint8_t status,
+              const uint32_t len)
+{
+    uint32_t    nid = htonl (id),
+                nlen = htonl (len);
+
+    memcpy (hdr, &nid, sizeof (nid));
+    hdr[sizeof (nid)] = status;
+    memcpy (hdr + sizeof (nid) + 1, &nlen, sizeof (nlen));
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+
+#define FRAME_HELLO         "FRAMED"    /* line switching to framed mode */
+
+#define FRAME_REQ_HDRLEN    6   /* id (4), key length (2) */
+#define FRAME_RESP_HDRLEN   9   /* id (4), status (1), payload length (4) */
+
+/* response status */
+#define FRAME_OK            0   /* framed mode negotiated */
+#define FRAME_HIT           1   /* payload from cache */
+#define FRAME_MISS          2   /* payload from remote host */
+#define FRAME_ERROR         3   /* no payload, request failed */
+
+
+extern size_t frame_hello (const uint8_t * buf, const size_t len);
+
+extern ssize_t frame_parse (const uint8_t * buf, const size_t len,
+                            uint32_t * id, const uint8_t ** key,
+                            size_t * keylen);
+
+extern void frame_header (uint8_t * hdr, const uint32_t id,
+                          const uint8_t status, const uint32_t len);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * 64 bit FNV-1a followed by the MurmurHash3 finalizer for better avalanche.
+ *
+ * Fast on short keys like "addr:port", but not cryptographic.
+ */
+static inline uint64_t
+hash64 (const uint8_t * buf, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= *buf++;
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+
+#define HASH64_ROTL(x, b)   (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define HASH64_SIPROUND(v0, v1, v2, v3)                                     \
+    do {                                                                    \
+        v0 += v1; v1 = HASH64_ROTL (v1, 13); v1 ^= v0;                      \
+        v0 = HASH64_ROTL (v0, 32);                                          \
+        v2 += v3; v3 = HASH64_ROTL (v3, 16); v3 ^= v2;                      \
+        v0 += v3; v3 = HASH64_ROTL (v3, 21); v3 ^= v0;                      \
+        v2 += v1; v1 = HASH64_ROTL (v1, 17); v1 ^= v2;                      \
+        v2 = HASH64_ROTL (v2, 32);                                          \
+    } while (0)
+
+
+/**
+ * SipHash-1-3 of "buf" keyed with "k0" and "k1".
+ *
+ * Without the key, inputs that collide cannot be found, unlike with hash64().
+ * Use it where colliding inputs would share state.
+ */
+static inline uint64_t
+hash64_keyed (const uint8_t * buf, size_t len, uint64_t k0, uint64_t k1)
+{
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL,
+             v1 = k1 ^ 0x646f72616e646f6dULL,
+             v2 = k0 ^ 0x6c7967656e657261ULL,
+             v3 = k1 ^ 0x7465646279746573ULL,
+             m,
+             b = (uint64_t) len << 56;
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        m = 0;
+        for (int i = 0; i < 8; i++) {
+            m |= (uint64_t) buf[i] << (8 * i);
+        }
+        v3 ^= m;
+        HASH64_SIPROUND (v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    /* last 0 to 7 bytes, little endian, with the length on top */
+    for (size_t i = 0; i < len; i++) {
+        b |= (uint64_t) buf[i] << (8 * i);
+    }
+    v3 ^= b;
+    HASH64_SIPROUND (v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 3; i++) {
+        HASH64_SIPROUND (v0, v1, v2, v3);
+    }
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -11,7 +11,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -20,69 +22,612 @@
 
 #include "netutil.h"
 #include "cache.h"
+#include "canon.h"
+#include "parse.h"
+#include "frame.h"
+#include "peer.h"
+#include "timer.h"
+#include "trace.h"
 
 
 #define NUMCHILDS           sysconf (_SC_NPROCESSORS_ONLN)  /* cpu cores */
 
 #define DEFAULT_PORT        "8090"
 #define BUFLEN              8192
+#define COALESCE_MAX        4096    /* gather cache hits up to this size */
+#define BATCH_IOVS          64
+#define OUTQ_MAX            (256 * 1024)    /* queued output before a client
+                                             * is no longer read from */
 
-#define CACHE_BASEDIR       "cache-ombud" /* TODO make this configurable */
+#define CACHE_BASEDIR       "cache-ombud"
 
-#define SERVMAXLEN          NI_MAXHOST + NI_MAXSERV + 1   /* "addr:port" */
+#define PEER_PREFIX         '@'     /* command from peer, never forwarded */
 
 /* constants we use with epoll */
 #define MAXEVENTS           64
 #define READ_CMD            1
 #define READ_REMOTE         2       /* read remote host data */
 #define RELAY_BACK          4       /* send remote host data to client */
+#define CONNECT_REMOTE      8       /* wait for remote host connection */
+#define LISTEN              16      /* accept clients */
+
+/* supervision of worker processes */
+#define SUPERVISE_INTERVAL  1       /* seconds between load checks */
+#define SCALE_UP_BUSY       75      /* % busy, average over workers */
+#define SCALE_DOWN_BUSY     25
+#define SCALE_UP_QUEUE      512     /* open commands per worker */
+#define SCALE_DOWN_CHECKS   30      /* quiet checks before scaling down */
+#define DRAIN_TIMEOUT       10      /* seconds a retiring worker may take */
+#define RESTART_QUICK       10      /* seconds, a worker dying sooner fails */
+#define RESTART_MAX         5       /* quick deaths in a row before giving up */
+
+/* default deadlines in seconds, 0 disables */
+#define IDLE_TIMEOUT        60      /* client sends no commands */
+#define CONNECT_TIMEOUT     5       /* remote host connection */
+#define READ_TIMEOUT        10      /* remote host data after connect */
 
 
 struct command {
-    uint8_t     cmd;        /* command, READ_REMOTE or RELAY_BACK */
-    int         cfd;        /* client socket */
+    uint8_t     cmd;        /* command, READ_REMOTE or RELAY_BACK, 0 once
+                             * no longer waiting on a socket */
+    int         cfd;        /* client socket, -1 once closed */
     int         rfd;        /* remote host socket */
+    struct command *client; /* client a fetch answers, NULL for refreshes */
+    uint32_t    pending;    /* fetches still answering this client */
+    uint8_t     eof;        /* client is done sending commands */
+    uint8_t     stalled;    /* reading paused until output drains */
+    uint8_t     broken;     /* writing failed, waiting for the hang up */
+    struct outbuf *outq;    /* client output waiting for EPOLLOUT */
+    struct outbuf *outq_tail;
+    size_t      outlen;     /* bytes in outq */
     uint8_t     *service;   /* client command: "ADDRESS:PORT\r\n" */
+    uint8_t     peer;       /* rfd is the peer node owning service */
+    uint8_t     framed;     /* client speaks the framed protocol */
+    uint32_t    id;         /* framed request id */
+    uint32_t    req;        /* trace id of connection or request */
+    uint8_t     *inbuf;     /* framed client input, BUFLEN bytes */
+    size_t      inlen;
+    struct timer timer;     /* idle, connect or read deadline */
+    struct command *next;   /* released, freed after the events at hand */
+};
+
+/* client output the socket could not take yet */
+struct outbuf {
+    struct outbuf   *next;
+    int             fd;         /* cache file to send from, -1 for data */
+    uint32_t        req;        /* traced request ending here, or 0 */
+    size_t          len;        /* bytes left */
+    size_t          off;        /* bytes of data sent */
+    uint8_t         data[];
+};
+
+/* responses to one read of client commands, coalesced */
+struct batch {
+    struct command  *client;
+    int             corked;     /* TCP_CORK set on client socket */
+    int             iovcnt;
+    size_t          used;       /* bytes of buf gathered */
+    uint32_t        reqs[BATCH_IOVS];   /* traced request ending at iov, or 0 */
+    struct iovec    iov[BATCH_IOVS];
+    uint8_t         buf[BUFLEN];
+};
+
+
+/* load a worker publishes to the master */
+struct worker_load {
+    uint64_t    busy_ns;    /* time spent handling events */
+    uint32_t    commands;   /* open client and remote commands */
+    uint32_t    ready;      /* set up and in the event loop */
 };
 
 
-/* book keeping of child processes */
+/* book keeping of child processes, negative pids are retiring */
 static pid_t *child_pids;
+static int numchilds;
+
+/* per worker slot, when it was started and when to restart it, 0 not, in
+ * milliseconds, and how often in a row it died quickly */
+static uint64_t *child_started,
+                *child_restart;
+static int *child_failures;
+
+/* per worker slot, shared between master and workers */
+static struct worker_load *loads;
+
+/* master is shutting down */
+static volatile sig_atomic_t quitting = 0;
+
+/* deadlines in milliseconds, 0 disables */
+static uint64_t idle_timeout    = IDLE_TIMEOUT * 1000,
+                connect_timeout = CONNECT_TIMEOUT * 1000,
+                read_timeout    = READ_TIMEOUT * 1000;
+
+/* refresh cache entries older than this in seconds, 0 never */
+static time_t soft_ttl = 0;
+
+static int durability = CACHE_SYNC_FULL;
+
+/* store identical contents once */
+static int dedup = 0;
+
+/* canonicalization of cache keys */
+static int key_mode = CANON_NONE;
+
+static const uint8_t *cache_basedir = (const uint8_t *) CACHE_BASEDIR;
+
+/* per process event loop and its timers */
+static int epollfd;
+static struct timer_wheel wheel;
+
+/* trace dump asked for by SIGUSR1 */
+static volatile sig_atomic_t trace_requested = 0;
+
+/* worker asked to finish open commands and exit by SIGTERM */
+static volatile sig_atomic_t draining = 0;
+
+/* open commands of this worker */
+static uint32_t ncommands = 0;
+
+/* released commands, events for them may still be pending */
+static struct command *released = NULL;
 
 
 /**
  * Convenience wrapper for adding and modifying epoll events.
  */
 static void
-epoll_add (int epollfd, struct command *command) {
+epoll_ctl_cmd (int op, struct command *command) {
     struct epoll_event      event;
     int                     fd;
 
-    if (command->cmd == READ_REMOTE) {
+    if (command->cmd & (READ_REMOTE | CONNECT_REMOTE)) {
         fd = command->rfd;  /* remote host socket */
     } else {
         fd = command->cfd;  /* client socket */
     }
 
     event.data.ptr = command;
-    event.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl (epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
-        err (1, "Could not add command to epoll");
+    /* non-blocking connect is done when the socket becomes writable, clients
+     * are written to when there is room for queued output */
+    if (command->cmd == CONNECT_REMOTE) {
+        event.events = EPOLLOUT | EPOLLET;
+    } else if (command->cmd == READ_CMD) {
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    } else {
+        event.events = EPOLLIN | EPOLLET;
+    }
+    if (epoll_ctl (epollfd, op, fd, &event) < 0) {
+        err (1, "Could not add or modify command to epoll");
     }
 }
 
+static void
+epoll_add (struct command *command) {
+    epoll_ctl_cmd (EPOLL_CTL_ADD, command);
+}
+
 /**
- * Used for toggling client socket connection between READ_CMD and READ_REMOTE.
+ * Used for toggling remote host socket from CONNECT_REMOTE to READ_REMOTE.
  */
 static void
-epoll_mod (int epollfd, struct command *command) {
-    struct epoll_event      event;
+epoll_mod (struct command *command) {
+    epoll_ctl_cmd (EPOLL_CTL_MOD, command);
+}
 
-    event.data.ptr = command;
-    event.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl (epollfd, EPOLL_CTL_MOD, command->cfd, &event) < 0) {
-        err (1, "Could not modify command to epoll");
+
+static void client_unref (struct command *client);
+static void arm_timer (struct command *command, const uint64_t timeout);
+
+/**
+ * Release command and disarm its deadline.
+ *
+ * The memory is only freed by free_released(), once the events at hand are
+ * processed, as some of them may still refer to the command.
+ */
+static void
+command_free (struct command *command)
+{
+    struct command *client = command->client;
+
+    timer_del (&wheel, &command->timer);
+    free (command->service);
+    free (command->inbuf);
+    command->service = NULL;
+    command->inbuf = NULL;
+    command->cmd = 0;
+    command->client = NULL;
+
+    command->next = released;
+    released = command;
+    ncommands--;
+
+    if (client) {
+        client_unref (client);
+    }
+}
+
+
+/**
+ * Free commands released while processing events.
+ */
+static void
+free_released (void)
+{
+    while (released) {
+        struct command *command = released;
+
+        released = command->next;
+        free (command);
+    }
+}
+
+
+/**
+ * Discard queued client output.
+ */
+static void
+outq_free (struct command *client)
+{
+    while (client->outq) {
+        struct outbuf *ob = client->outq;
+
+        client->outq = ob->next;
+        if (ob->fd >= 0) {
+            close (ob->fd);
+        }
+        free (ob);
+    }
+
+    client->outq_tail = NULL;
+    client->outlen = 0;
+}
+
+
+/**
+ * Close client socket. The command is released once no fetch is answering
+ * the client anymore.
+ */
+static void
+client_close (struct command *client)
+{
+    close (client->cfd);    /* also removes from epoll */
+    client->cfd = -1;
+    client->cmd = 0;
+    timer_del (&wheel, &client->timer);
+    outq_free (client);
+
+    if (!client->pending) {
+        command_free (client);
+    }
+}
+
+
+/**
+ * Close client that sent its last command once every response is sent.
+ */
+static void
+client_check_done (struct command *client)
+{
+    if (client->eof && !client->pending && !client->outq &&
+        (client->cfd >= 0))
+    {
+        client_close (client);
+    }
+}
+
+
+/**
+ * Client is done sending commands, close it right away unless there are
+ * responses still to be sent.
+ */
+static void
+client_eof (struct command *client)
+{
+    client->eof = 1;
+    client_check_done (client);
+}
+
+
+/**
+ * A fetch answering client is done.
+ */
+static void
+client_unref (struct command *client)
+{
+    if (--client->pending) {
+        return;
+    }
+
+    if (client->cfd < 0) {
+        command_free (client);
+    } else {
+        client_check_done (client);
+    }
+}
+
+
+/**
+ * Writing to client failed. It can not be closed yet, its socket and
+ * command may still be in use further up the stack, so stop all traffic;
+ * the resulting EOF or hang up closes it.
+ */
+static void
+client_broken (struct command *client)
+{
+    warn ("Could not send to client");
+    client->broken = 1;
+    outq_free (client);
+    shutdown (client->cfd, SHUT_RDWR);
+}
+
+
+/**
+ * Append output to the client queue, "fd" is a cache file to send "len"
+ * bytes from, or -1 for "len" bytes of "data". The last byte of traced
+ * request "req" is recorded once it is sent.
+ */
+static void
+outq_add (struct command *client, const int fd, const uint8_t *data,
+          const size_t len, const uint32_t req)
+{
+    struct outbuf *ob = malloc (sizeof (*ob) + (fd < 0 ? len : 0));
+
+    ob->next = NULL;
+    ob->fd = fd;
+    ob->req = req;
+    ob->len = len;
+    ob->off = 0;
+    if (fd < 0) {
+        memcpy (ob->data, data, len);
+    }
+
+    if (client->outq_tail) {
+        client->outq_tail->next = ob;
+    } else {
+        client->outq = ob;
+    }
+    client->outq_tail = ob;
+    client->outlen += len;
+}
+
+
+/**
+ * Send iov to client, what the socket does not take now is queued and sent
+ * once it becomes writable again.
+ *
+ * "reqs", if given, holds for every iov entry the traced request it is the
+ * last of, or 0.
+ */
+static void
+client_writev (struct command *client, const struct iovec *iov,
+               const uint32_t *reqs, const int iovcnt)
+{
+    struct iovec    tmp[BATCH_IOVS];
+    ssize_t         sentbytes = 0;
+
+    if ((client->cfd < 0) || client->broken) {
+        return;
+    }
+
+    /* keep responses in order, nothing jumps the queue */
+    if (!client->outq) {
+        memcpy (tmp, iov, iovcnt * sizeof (*iov));
+        if ((sentbytes = writevall (client->cfd, tmp, iovcnt)) < 0) {
+            client_broken (client);
+            return;
+        }
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if ((size_t) sentbytes >= iov[i].iov_len) {
+            sentbytes -= iov[i].iov_len;
+            if (reqs && reqs[i]) {
+                trace (reqs[i], TRACE_LAST_BYTE, 0);
+            }
+            continue;
+        }
+
+        outq_add (client, -1, (uint8_t *) iov[i].iov_base + sentbytes,
+                  iov[i].iov_len - sentbytes, reqs ? reqs[i] : 0);
+        sentbytes = 0;
+    }
+}
+
+
+/**
+ * Send "fsize" bytes of cache file "fd", the response to traced request
+ * "req", to client, queueing what the socket does not take now.
+ */
+static void
+client_sendfile (struct command *client, const int fd, const size_t fsize,
+                 const uint32_t req)
+{
+    ssize_t sentbytes = 0;
+    int     qfd;
+
+    if ((client->cfd < 0) || client->broken) {
+        return;
+    }
+
+    if (!client->outq) {
+        if ((sentbytes = cache_sendfd (client->cfd, fd, fsize)) < 0) {
+            client_broken (client);
+            return;
+        }
+        if ((size_t) sentbytes == fsize) {
+            trace (req, TRACE_LAST_BYTE, 0);
+            return;
+        }
+    }
+
+    /* the file position tells where sending continues */
+    if ((qfd = dup (fd)) < 0) {
+        warn ("Could not queue cache hit");
+        client_broken (client);
+        return;
+    }
+    outq_add (client, qfd, NULL, fsize - sentbytes, req);
+}
+
+
+/**
+ * Client socket has room again, send queued output.
+ */
+static void
+client_flush (struct command *client)
+{
+    while (client->outq) {
+        struct outbuf   *ob = client->outq;
+        ssize_t         sentbytes;
+
+        if (ob->fd >= 0) {
+            sentbytes = cache_sendfd (client->cfd, ob->fd, ob->len);
+        } else {
+            struct iovec iov = {
+                .iov_base = ob->data + ob->off,
+                .iov_len = ob->len
+            };
+
+            sentbytes = writevall (client->cfd, &iov, 1);
+        }
+
+        if (sentbytes < 0) {
+            client_broken (client);
+            return;
+        }
+
+        ob->len -= sentbytes;
+        ob->off += sentbytes;
+        client->outlen -= sentbytes;
+        if (sentbytes) {
+            /* a slow reader is not idle */
+            arm_timer (client, idle_timeout);
+        }
+        if (ob->len) {
+            /* wait for more room */
+            return;
+        }
+
+        client->outq = ob->next;
+        if (ob->req) {
+            trace (ob->req, TRACE_LAST_BYTE, 0);
+        }
+        if (ob->fd >= 0) {
+            close (ob->fd);
+        }
+        free (ob);
+    }
+
+    client->outq_tail = NULL;
+    client_check_done (client);
+}
+
+
+/**
+ * Close the socket a command is waiting on and release the command.
+ */
+static void
+drop_command (struct command *command)
+{
+    if (command->cmd & (READ_REMOTE | CONNECT_REMOTE)) {
+        close (command->rfd);   /* also removes from epoll */
+        command_free (command);
+    } else {
+        client_close (command);
+    }
+}
+
+
+/**
+ * Tell framed client that request "id" failed, text clients get nothing.
+ */
+static void
+reply_error (struct command *client, const uint32_t id)
+{
+    uint8_t         hdr[FRAME_RESP_HDRLEN];
+    struct iovec    iov = { .iov_base = hdr, .iov_len = sizeof (hdr) };
+
+    if (!client || !client->framed) {
+        return;
+    }
+
+    frame_header (hdr, id, FRAME_ERROR, 0);
+    client_writev (client, &iov, NULL, 1);
+}
+
+
+static void fetch_remote (struct command *client, const uint32_t id,
+                          const uint32_t req, uint8_t *service,
+                          const uint8_t *peer);
+
+/**
+ * Fetching from remote host failed, if it was the peer owning the service
+ * fall back to fetching from the remote host itself.
+ */
+static void
+remote_failed (struct command *command)
+{
+    struct command  *client = command->client;
+    uint8_t         *service = command->service;
+    uint32_t        id = command->id,
+                    req = command->req;
+
+    if (!command->peer) {
+        reply_error (client, id);
+        drop_command (command);
+        return;
+    }
+
+    /* the client has to outlive the failed fetch */
+    if (client) {
+        client->pending++;
+    }
+
+    command->service = NULL;
+    drop_command (command);
+
+    fetch_remote (client, id, req, service, NULL);
+
+    if (client) {
+        client_unref (client);
+    }
+}
+
+
+/**
+ * Deadline passed, reclaim socket and command.
+ */
+static void
+expire_command (struct timer *timer)
+{
+    struct command *command = timer->data;
+
+    if (command->service) {
+        warnx ("%s: timed out", (char *) command->service);
+    }
+
+    if (command->cmd & (READ_REMOTE | CONNECT_REMOTE)) {
+        remote_failed (command);
+    } else {
+        drop_command (command);
+    }
+}
+
+
+/**
+ * (Re)arm command deadline, a zero timeout disarms it.
+ */
+static void
+arm_timer (struct command *command, const uint64_t timeout)
+{
+    if (!timeout) {
+        timer_del (&wheel, &command->timer);
+        return;
     }
+
+    command->timer.cb = expire_command;
+    command->timer.data = command;
+    timer_add (&wheel, &command->timer, timeout);
 }
 
 
@@ -90,7 +635,7 @@ epoll_mod (int epollfd, struct command *command) {
  * Process all incoming connections.
  */
 static void
-do_accept (const int listensock, const int epollfd)
+do_accept (const int listensock)
 {
     for (;;) {
         int                         client_socket;
@@ -123,257 +668,773 @@ do_accept (const int listensock, const int epollfd)
         if (mk_nonblock (client_socket) < 0) {
             err (1, "Could not make client socket non-blocking");
         }
-#endif
+#endif
+
+        /* create read client command */
+        command = calloc (1, sizeof (struct command));
+        ncommands++;
+        command->cmd = READ_CMD;
+        command->cfd = client_socket;
+        command->req = trace_request ();
+        trace (command->req, TRACE_ACCEPTED, 0);
+
+        /* hang up on clients that never send anything */
+        arm_timer (command, idle_timeout);
+
+        /* add command to epoll event queue */
+        epoll_add (command);
+    }
+}
+
+
+/**
+ * Connect to remote host, return non-blocking socket.
+ *
+ * The connection is usually still in progress when this returns, which is
+ * signaled through "inprogress". The socket becomes writable once done.
+ */
+static int
+connect_remote_host (const uint8_t *remote_srv, const ssize_t len,
+                     const uint32_t req, int *inprogress)
+{
+    uint8_t             *remote_host = calloc (1, NI_MAXHOST),
+                        *remote_port = calloc (1, NI_MAXSERV);
+
+    struct addrinfo     hints,
+                        *remoteinfo,
+                        *rp;
+
+    int                 rsock = -1;
+
+
+    /* extract remote host and port as strings */
+    if (extract_host_port (remote_srv, len, remote_host, remote_port) < 0) {
+        free (remote_host);
+        free (remote_port);
+        return -1;
+    }
+
+    bzero (&hints, sizeof (struct addrinfo));
+    hints.ai_family   = AF_INET;        /* IPv4 */
+    hints.ai_socktype = SOCK_STREAM;    /* TCP */
+
+    int r = getaddrinfo ((char *) remote_host, (char *) remote_port,
+                         &hints, &remoteinfo);
+    free (remote_host);
+    free (remote_port);
+    trace (req, TRACE_RESOLVE, 0);
+    if (r != 0) {
+        warnx ("getaddrinfo: %s", gai_strerror (r));
+        return -1;
+    }
+
+    for (rp = remoteinfo; rp != NULL; rp = rp->ai_next) {
+        if ((rsock = socket (rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+                             rp->ai_protocol)) < 0) {
+            /* don't continue if we could not establish a socket connection */
+            rp = NULL;
+            break;
+        }
+
+        if (connect (rsock, rp->ai_addr, rp->ai_addrlen) == 0) {
+            *inprogress = 0;
+            break;
+        } else if (errno == EINPROGRESS) {
+            /* finished when socket becomes writable */
+            *inprogress = 1;
+            break;
+        }
+
+        close (rsock);
+        warn ("data: connect");
+    }
+
+    freeaddrinfo (remoteinfo);
+
+    if (rp == NULL) {
+        /* could not connect, silently drop this. */
+        return -1;
+    }
+
+    return rsock;
+}
+
+
+/**
+ * Hold back partial segments until the batch ends.
+ */
+static void
+batch_cork (struct batch *batch)
+{
+    if (!batch->corked && sock_cork (batch->client->cfd, 1) == 0) {
+        batch->corked = 1;
+    }
+}
+
+
+/**
+ * Send gathered responses with a single writev(2).
+ */
+static void
+batch_flush (struct batch *batch)
+{
+    if (batch->iovcnt) {
+        client_writev (batch->client, batch->iov, batch->reqs,
+                       batch->iovcnt);
+    }
+
+    batch->iovcnt = 0;
+    batch->used = 0;
+}
+
+
+/**
+ * Make room for "len" more bytes in batch, flushing it if needed.
+ */
+static void
+batch_reserve (struct batch *batch, const size_t len)
+{
+    if ((batch->used + len > sizeof (batch->buf)) ||
+        (batch->iovcnt == BATCH_IOVS))
+    {
+        batch_cork (batch);
+        batch_flush (batch);
+    }
+}
+
+
+/**
+ * Append "len" bytes of the batch buffer as one iov entry.
+ */
+static void
+batch_push (struct batch *batch, const size_t len)
+{
+    batch->iov[batch->iovcnt].iov_base = batch->buf + batch->used;
+    batch->iov[batch->iovcnt].iov_len = len;
+    batch->reqs[batch->iovcnt] = 0;
+    batch->iovcnt++;
+    batch->used += len;
+}
+
+
+/**
+ * Add an empty framed response with "status" to batch.
+ */
+static void
+batch_status (struct batch *batch, const uint32_t id, const uint8_t status)
+{
+    batch_reserve (batch, FRAME_RESP_HDRLEN);
+    frame_header (batch->buf + batch->used, id, status, 0);
+    batch_push (batch, FRAME_RESP_HDRLEN);
+}
+
+
+/**
+ * Add cache hit "fd" of traced request "req" to batch, "last" tells if no
+ * more responses follow. Framed responses get a header with request "id".
+ *
+ * Small objects are gathered in memory and sent together, larger ones are
+ * sent with sendfile(2). The socket is corked when the batch needs more than
+ * one write, so the responses leave in as few segments as possible.
+ */
+static void
+batch_add (struct batch *batch, const uint8_t framed, const uint32_t id,
+           const uint32_t req, const int fd, const size_t fsize,
+           const int last)
+{
+    size_t  hdrlen = framed ? FRAME_RESP_HDRLEN : 0;
+    ssize_t readbytes;
+
+    if (fsize <= COALESCE_MAX) {
+        batch_reserve (batch, hdrlen + fsize);
+
+        /* header goes in front of the payload, once its length is known */
+        readbytes = read (fd, batch->buf + batch->used + hdrlen, fsize);
+        if (readbytes <= 0) {
+            if (framed) {
+                batch_status (batch, id, FRAME_ERROR);
+            }
+            return;
+        }
+
+        if (framed) {
+            frame_header (batch->buf + batch->used, id, FRAME_HIT, readbytes);
+        }
+        batch_push (batch, hdrlen + readbytes);
+        batch->reqs[batch->iovcnt - 1] = req;
+        return;
+    }
+
+    if (framed) {
+        batch_reserve (batch, hdrlen);
+        frame_header (batch->buf + batch->used, id, FRAME_HIT, fsize);
+        batch_push (batch, hdrlen);
+    }
+
+    if (batch->iovcnt || !last) {
+        batch_cork (batch);
+    }
+    batch_flush (batch);
+    client_sendfile (batch->client, fd, fsize, req);
+}
+
+
+/**
+ * Send what is left of the batch and push out held back segments.
+ */
+static void
+batch_end (struct batch *batch)
+{
+    batch_flush (batch);
+
+    if (batch->corked && (batch->client->cfd >= 0)) {
+        sock_cork (batch->client->cfd, 0);
+        batch->corked = 0;
+    }
+}
+
+
+/**
+ * Connected to remote host, ask peer for the service and wait for data.
+ */
+static void
+remote_connected (struct command *command)
+{
+    command->cmd = READ_REMOTE;
+    trace (command->req, TRACE_CONNECT, 0);
+
+    if (command->peer) {
+        uint8_t request[SERVMAXLEN + 3];
+        size_t  reqlen = snprintf ((char *) request, sizeof (request),
+                                   "%c%s\r\n", PEER_PREFIX,
+                                   (char *) command->service);
+
+        if (!sendall (command->rfd, request, &reqlen)) {
+            warn ("Could not send request to peer");
+        }
+
+        /* the peer may have to fetch from the remote host itself */
+        arm_timer (command, connect_timeout + read_timeout);
+    } else {
+        arm_timer (command, read_timeout);
+    }
+}
+
+
+/**
+ * Start fetching "service" for "client", from the cluster node "peer" if
+ * given, otherwise from the remote host itself. Framed clients get the
+ * response to request "id". Without a client, i.e. NULL, the service is only
+ * (re)cached. Progress is traced as request "req".
+ *
+ * The service string is owned by the fetch from here on.
+ */
+static void
+fetch_remote (struct command *client, const uint32_t id, const uint32_t req,
+              uint8_t *service, const uint8_t *peer)
+{
+    const uint8_t   *target = peer ? peer : service;
+    int             rsock,
+                    inprogress;
+
+    if ((rsock = connect_remote_host (target, strlen ((char *) target), req,
+                                      &inprogress)) < 0) {
+        if (peer) {
+            warnx ("could not connect to peer %s", (char *) peer);
+            fetch_remote (client, id, req, service, NULL);
+            return;
+        }
+
+        warnx ("could not connect to host %s", (char *) service);
+        reply_error (client, id);
+        free (service);
+        return;
+    }
+
+    struct command *newcmd = calloc (1, sizeof (struct command));
+    ncommands++;
+    /* add command to read remote host data to event queue */
+    newcmd->cmd = CONNECT_REMOTE;
+    newcmd->cfd = -1;
+    newcmd->rfd = rsock;
+    newcmd->client = client;
+    newcmd->service = service;
+    newcmd->peer = peer != NULL;
+    newcmd->id = id;
+    newcmd->req = req;
+
+    /* client stays around until answered */
+    if (client) {
+        client->pending++;
+    }
+
+    if (inprogress) {
+        arm_timer (newcmd, connect_timeout);
+    } else {
+        remote_connected (newcmd);
+    }
+
+    /* add command to event queue */
+    epoll_add (newcmd);
+}
+
+
+/**
+ * Answer client request for "service" from cache, or start fetching it on a
+ * miss. The service string is consumed.
+ */
+static void
+serve (struct command *client, struct batch *batch, uint8_t *service,
+       const uint32_t id, const int last)
+{
+    size_t      fsize;
+    int         fd,
+                stale,
+                from_peer = (*service == PEER_PREFIX);
+    uint32_t    req = trace_request ();
+
+    trace (req, TRACE_PARSED, client->req);
+
+    /* peer nodes ask with a prefix, strip it */
+    if (from_peer) {
+        memmove (service, service + 1, strlen ((char *) service));
+    }
+
+    /* one key however the client names the service, peers get it too */
+    if (key_mode != CANON_NONE) {
+        uint8_t *canon = canon_key (service, key_mode);
+
+        if (canon) {
+            free (service);
+            service = canon;
+        }
+    }
+
+    /* try sending from cache, upon miss defer remote host read */
+    fd = cache_open (service, &fsize, &stale);
+    trace (req, TRACE_LOOKUP, 0);
+    if (fd >= 0) {
+        if (fsize > 0) {
+            batch_add (batch, client->framed, id, req, fd, fsize, last);
+            close (fd);
+
+            /* stale entry was served anyway, refresh it without a client */
+            if (stale) {
+                fetch_remote (NULL, 0, req, service, NULL);
+            } else {
+                free (service);
+            }
+            return;
+        }
+        /* empty entry, treat as miss */
+        close (fd);
+    }
+
+    /* ask the owning peer first, unless a peer is asking us */
+    fetch_remote (client, id, req, service,
+                  from_peer ? NULL : peer_owner (service));
+}
+
+
+/**
+ * Serve all complete request frames in the input buffer of framed client.
+ */
+static void
+do_frames (struct command *command)
+{
+    struct batch    batch;
+    size_t          off = 0,
+                    keylen;
+    ssize_t         framelen;
+    uint32_t        id;
+    const uint8_t   *key;
+
+    batch.client = command;
+    batch.corked = 0;
+    batch.iovcnt = 0;
+    batch.used = 0;
+
+    /* a client not reading its responses gets no more of them */
+    while ((command->outlen <= OUTQ_MAX) &&
+           ((framelen = frame_parse (command->inbuf + off,
+                                     command->inlen - off,
+                                     &id, &key, &keylen)) > 0)) {
+        off += framelen;
+
+        if (!keylen || keylen >= SERVMAXLEN) {
+            batch_status (&batch, id, FRAME_ERROR);
+            continue;
+        }
+
+        serve (command, &batch,
+               (uint8_t *) strndup ((char *) key, keylen), id,
+               command->inlen - off < FRAME_REQ_HDRLEN);
+    }
+
+    /* keep partial frame for next read */
+    memmove (command->inbuf, command->inbuf + off, command->inlen - off);
+    command->inlen -= off;
+
+    batch_end (&batch);
+}
+
+
+/**
+ * Read request frames from framed client until the socket is drained, or
+ * until the client has OUTQ_MAX bytes of responses it has not read yet.
+ *
+ * A frame never outgrows the input buffer, a client sending one that does
+ * fills it up and is dropped.
+ */
+static void
+do_read_frames (struct command *command)
+{
+    ssize_t readbytes;
+
+    for (;;) {
+        /* serve what was read before */
+        do_frames (command);
+
+        if (command->outlen > OUTQ_MAX) {
+            command->stalled = 1;
+            return;
+        } else if (command->inlen == BUFLEN) {
+            warnx ("framed request too large");
+            drop_command (command);
+            return;
+        }
+
+        readbytes = read (command->cfd, command->inbuf + command->inlen,
+                          BUFLEN - command->inlen);
+
+        if ((readbytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            /* read everything there was */
+            break;
+        } else if (readbytes < 0) {
+            perror ("ctrlsock read error");
+            drop_command (command);
+            return;
+        } else if (readbytes == 0) {
+            /* EOF, answer what is in flight before closing */
+            client_eof (command);
+            return;
+        }
 
-        /* create read client command */
-        command = calloc (1, sizeof (struct command));
-        command->cmd = READ_CMD;
-        command->cfd = client_socket;
+        /* client is active, push idle deadline forward */
+        arm_timer (command, idle_timeout);
 
-        /* add command to epoll event queue */
-        epoll_add (epollfd, command);
+        command->inlen += readbytes;
     }
 }
 
 
 /**
- * Extract remote host and port from remote service string.
+ * Switch client to framed protocol, "buf" holds what was read after the
+ * hello line.
  */
-static int
-extract_host_port (const uint8_t *remote_srv, const ssize_t len,
-                     uint8_t *remote_host, uint8_t *remote_port)
+static void
+framed_start (struct command *command, const uint8_t *buf, const size_t len)
 {
-    uint8_t *s, *h, *p;
+    uint8_t         hdr[FRAME_RESP_HDRLEN];
+    struct iovec    iov = { .iov_base = hdr, .iov_len = sizeof (hdr) };
 
-    s = h = (uint8_t *) strndup ((char *) remote_srv, len);
-    s += len;
-    /* search for ':' from the back of supplied string, stop when we searched
-     * through everything. */
-    for (; (*(--s) != ':') && (s != h) ;);
+    command->framed = 1;
+    command->inbuf = malloc (BUFLEN);
+    command->inlen = len;
+    memcpy (command->inbuf, buf, len);
 
-    if (s == remote_host) {
-        warn ("Invalid argument %s", remote_host);
-        return -1;
-    }
+    /* acknowledge, every response is framed from here on */
+    frame_header (hdr, 0, FRAME_OK, 0);
+    client_writev (command, &iov, NULL, 1);
 
-    /* split supplied string into host and port */
-    *s = '\0';
-    p = s + 1;
+    arm_timer (command, idle_timeout);
 
-    /* "return values", remote host and port */
-    strncat ((char *) remote_host, (char *) h, strlen ((char *) h));
-    strncat ((char *) remote_port, (char *) p, strlen ((char *) p));
-
-    return 1;
+    do_read_frames (command);
 }
 
 
 /**
- * Connect to remote host, return socket.
+ * Process read (client) command.
+ *
+ * The socket is edge triggered, so it is read until drained. Otherwise the
+ * EOF of a client that sends its commands and closes would go unnoticed and
+ * the socket would linger until the idle deadline.
  */
-static int
-connect_remote_host (const uint8_t *remote_srv, const ssize_t len)
+static void
+do_read_cmd (struct command * command)
 {
-    uint8_t             *remote_host = calloc (1, NI_MAXHOST),
-                        *remote_port = calloc (1, NI_MAXSERV);
+    uint8_t buf[BUFLEN];
+    ssize_t readbytes;
+    size_t  hellolen;
 
-    struct addrinfo     hints,
-                        *remoteinfo,
-                        *rp;
+    if (command->framed) {
+        do_read_frames (command);
+        return;
+    }
 
-    int                 rsock;
+    for (;;) {
+        /* client is not reading its responses, wait for it to catch up */
+        if (command->outlen > OUTQ_MAX) {
+            command->stalled = 1;
+            return;
+        }
 
+        /* read command(s) from client, leave room for string terminator */
+        readbytes = read (command->cfd, buf, BUFLEN - 1);
 
-    /* extract remote host and port as strings */
-    if (extract_host_port (remote_srv, len, remote_host, remote_port) < 0) {
-        return -1;
-    }
+        if ((readbytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            /* read everything there was */
+            return;
+        } else if (readbytes < 0) {
+            perror ("ctrlsock read error");
+            drop_command (command); /* close also removes from epoll */
+            return;
+        } else if (readbytes == 0) {
+            /* EOF, answer what is in flight before closing */
+            client_eof (command);
+            return;
+        }
+        buf[readbytes] = '\0';
 
-    bzero (&hints, sizeof (struct addrinfo));
-    hints.ai_family   = AF_INET;        /* IPv4 */
-    hints.ai_socktype = SOCK_STREAM;    /* TCP */
+        /* client asks for framed protocol */
+        if ((hellolen = frame_hello (buf, readbytes)) > 0) {
+            framed_start (command, buf + hellolen, readbytes - hellolen);
+            return;
+        }
 
-    int r;
-    if ((r = getaddrinfo ((char *) remote_host, (char *) remote_port,
-                          &hints, &remoteinfo)) != 0) {
-        warn ("getaddrinfo: %s", gai_strerror (r));
-        return -1;
-    }
+        /* send from cache or defer relay */
+        uint8_t         **services = extract_cmds (buf);
+        struct batch    batch;
 
-    for (rp = remoteinfo; rp != NULL; rp++) {
-        if ((rsock = socket (rp->ai_family, rp->ai_socktype,
-                             rp->ai_protocol)) < 0) {
-            /* don't continue if we could not establish a socket connection */
-            rp = NULL;
-            break;
-        }
+        batch.client = command;
+        batch.corked = 0;
+        batch.iovcnt = 0;
+        batch.used = 0;
 
-        if (connect (rsock, rp->ai_addr, rp->ai_addrlen) < 0) {
-            close (rsock);
-            warn ("data: connect");
-            continue;
+        /* client is active, push idle deadline forward */
+        arm_timer (command, idle_timeout);
+
+        for (uint8_t **s = services; s && *s; ++s) {
+            serve (command, &batch, *s, 0, !s[1]);
         }
 
-        break;
+        /* processed all commands, client socket stays in READ_CMD */
+        batch_end (&batch);
+        free (services);
     }
+}
 
-    if (rp == NULL) {
-        /* could not connect, silently drop this. */
-        return -1;
-    }
 
-    if (mk_nonblock (rsock) < 0) {
-        err (1, "could not make data socket nonblocking");
+/**
+ * Client socket is readable or writable.
+ */
+static void
+do_client (struct command *command, const uint32_t events)
+{
+    if (events & EPOLLOUT) {
+        client_flush (command);
+
+        /* caught up, read the requests left waiting */
+        if (command->cmd && command->stalled &&
+            (command->outlen <= OUTQ_MAX))
+        {
+            command->stalled = 0;
+            do_read_cmd (command);
+            return;
+        }
     }
 
-    return rsock;
+    if (command->cmd && !command->stalled && (events & EPOLLIN)) {
+        do_read_cmd (command);
+    }
 }
 
 
 /**
- * Extract commands from client buffer.
- *
- * The function dynamically allocates a memory region for the parsed result.
+ * Remote host connection attempt finished, start reading on success.
  */
-static uint8_t**
-extract_cmds (const uint8_t *buf)
+static void
+do_connect_remote (struct command *command)
 {
-    uint8_t     num = 0;
-    uint8_t     **cmds = calloc (1, SERVMAXLEN);
-
+    int         error = 0;
+    socklen_t   errlen = sizeof (error);
 
-    /* split on newlines, allow commands with only \n as well as \r\n */
-    uint8_t     *tok = (uint8_t *) strtok ((char *) buf, "\n");
+    if (getsockopt (command->rfd, SOL_SOCKET, SO_ERROR, &error, &errlen) < 0) {
+        error = errno;
+    }
 
-    /* extract each command from user input */
-    for (;;) {
-        /* exhausted input buffer */
-        if (!tok) {
-            cmds[num++] = NULL;
-            break;
-        }
+    if (error) {
+        warnx ("%s: connect: %s", (char *) command->service,
+               strerror (error));
+        remote_failed (command);
+        return;
+    }
 
-        /* remove possible carriage return */
-        uint8_t *cr;
-        if ((cr = (uint8_t *) strrchr ((char *) tok, '\r')) != NULL) {
-            *cr = '\0';
-        }
+    remote_connected (command);
+    epoll_mod (command);
+}
 
-        /* duplicate and save command if it exists */
-        cmds[num++] = tok ? (uint8_t *) strdup ((char *) tok) : tok;
 
-        /* alloc place for another command */
-        cmds = realloc (cmds, (num + 2) * SERVMAXLEN);
-        tok = (uint8_t *) strtok (NULL, "\n");
+/**
+ * Relay data read from remote host back to the client of command.
+ */
+static void
+relay_back (const struct command *command, uint8_t *buf, size_t buflen)
+{
+    struct command  *client = command->client;
+    uint8_t         hdr[FRAME_RESP_HDRLEN];
+    struct iovec    iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof (hdr) },
+        { .iov_base = buf, .iov_len = buflen }
+    };
+    uint32_t        reqs[2] = { 0, command->req };
+
+    if (!client) {
+        /* background refresh, nobody to relay to */
+        return;
     }
 
-    return cmds;
+    if (client->framed) {
+        frame_header (hdr, command->id, FRAME_MISS, buflen);
+        client_writev (client, iov, reqs, 2);
+    } else {
+        client_writev (client, &iov[1], &reqs[1], 1);
+    }
 }
 
 
 /**
- * Process read (client) command.
+ * Read from remote host and relay back to client.
+ *
+ * Data from a peer node is not cached here, the peer owning it already has
+ * it. If the peer has nothing to send, fall back to the remote host itself.
  */
 static void
-do_read_cmd (const int epollfd, struct command * command)
+do_read_remote (struct command *command)
 {
-    uint8_t buf[BUFLEN] = { 0 };
+    uint8_t buf[BUFLEN];
     ssize_t readbytes;
 
-    /* read command(s) from client */
-    if ((readbytes = read (command->cfd, buf, BUFLEN)) <= 0) {
+    /* recv on remote data socket */
+    if ((readbytes = read (command->rfd, buf, BUFLEN)) <= 0) {
+        /* connection closed or socket error */
         if (readbytes == 0) {
-            /* EOF, client closed socket */
-            ;
+            /* EOF, remote host closed socket */
         } else {
-            perror ("ctrlsock read error");
+            perror ("data recv error");
         }
-        close (command->cfd); /* also removes from epoll */
+
+        remote_failed (command);
+        return;
     }
-    /* send from cache or defer relay */
-    else {
-        uint8_t **services = extract_cmds (buf);
+    trace (command->req, TRACE_FIRST_BYTE, 0);
 
-        for (; services && *services; ++services) {
-            uint8_t *service = *services;
+    /* only cache actual data */
+    if (!command->peer) {
+        if (cache_write (command->service, buf, readbytes) < 0) {
+            warn ("Could not write to cache");
+        }
+        trace (command->req, TRACE_CACHE_WRITE, 0);
+    }
 
-            /* try sending from cache, upon miss defer remote host read */
-            if (!cache_sendfile (command->cfd, service))
-            {
-                int rsock;
-                if ((rsock = connect_remote_host (service, readbytes)) < 0) {
-                    warn ("could not connect to host");
-                    return;
-                }
+    relay_back (command, buf, readbytes);
 
-                struct command *newcmd = calloc (1, sizeof (struct command));
-                /* add command to read remote host data to event queue */
-                newcmd->cmd = READ_REMOTE;
-                newcmd->cfd = command->cfd;
-                newcmd->rfd = rsock;
-                newcmd->service = service;
+    /* done with remote host, whatever was sent has been read */
+    close (command->rfd);
+    command_free (command);
+}
+
+
+/**
+ * Ask the event loop to dump the trace, it is not safe to do so from here.
+ */
+static void
+trace_sighandler (int signal)
+{
+    (void) signal;
+    trace_requested = 1;
+}
 
-                /* add command to event queue */
-                epoll_add (epollfd, newcmd);
-            }
-        }
 
-        /* processed all commands, back to READ_CMD */
-        struct command *readcmd = calloc (1, sizeof (struct command));
+/**
+ * Write the trace of this process to "ombud-trace.PID.json".
+ */
+static void
+do_trace_dump (void)
+{
+    char path[64];
 
-        readcmd->cmd = READ_CMD;
-        readcmd->cfd = command->cfd;
+    trace_requested = 0;
 
-        epoll_mod (epollfd, readcmd);
+    snprintf (path, sizeof (path), "ombud-trace.%d.json", getpid ());
+    if (trace_dump (path) != 0) {
+        warn ("Could not dump trace to %s", path);
     }
 }
 
 
 /**
- * Read from remote host.
+ * Stop accepting, finish open commands and exit.
  */
 static void
-do_read_remote (struct command *command, uint8_t *buf, ssize_t *buflen)
+drain_sighandler (int signal)
 {
-    ssize_t readbytes;
+    (void) signal;
+    draining = 1;
+}
 
-    /* recv on remote data socket */
-    if ((readbytes = read (command->rfd, buf, BUFLEN)) <= 0) {
-        /* connection closed or socket error */
-        if (readbytes == 0) {
-            /* EOF, remote host closed socket */
-        } else {
-            perror ("data recv error");
-        }
 
-        /* close socket to remote host */
-        close (command->rfd);
-    }
+/**
+ * Current monotonic time in nanoseconds.
+ */
+static uint64_t
+clock_ns (void)
+{
+    struct timespec ts;
 
-    if (cache_write (command->service, buf, readbytes) < 0) {
-        warn ("Could not write to cache");
-    }
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    free (command->service);
-    free (command);
 
-    /* "return value" read bytes */
-    *buflen = readbytes;
+/**
+ * Publish load of this worker to the master.
+ */
+static void
+publish_load (struct worker_load *load, const uint64_t busy_ns)
+{
+    __atomic_store_n (&load->busy_ns, load->busy_ns + busy_ns,
+                      __ATOMIC_RELAXED);
+    __atomic_store_n (&load->commands, ncommands, __ATOMIC_RELAXED);
 }
 
 
 /**
  * Main server event loop.
+ *
+ * On SIGTERM the connections queued on the listen socket are accepted and
+ * it is closed, letting the other workers take new connections, and the
+ * loop runs until the open commands are done or DRAIN_TIMEOUT passed.
  */
 static int
-child (const int8_t index, const uint8_t *server_port)
+child (const int index, const uint8_t *server_port)
 {
-    int                         listensock,
-                                epollfd;
+    int                         listensock;
 
     struct epoll_event          event,
                                 *events;
 
+    uint64_t                    drain_deadline = 0;
+
+
+    /* the master owns SIGINT handling, workers just die */
+    signal (SIGINT, SIG_DFL);
+    /* clients that hang up show as write errors */
+    signal (SIGPIPE, SIG_IGN);
+    signal (SIGTERM, drain_sighandler);
+    /* dump trace on demand, interrupts epoll_wait() */
+    signal (SIGUSR1, trace_sighandler);
 
     /* setup listen socket */
     if ((listensock = setup_listener (server_port)) < 0) {
@@ -384,9 +1445,12 @@ child (const int8_t index, const uint8_t *server_port)
              index, (char *) server_port);
 
     /* initialize cache */
-    if (cache_init ((const uint8_t *) CACHE_BASEDIR) < 0) {
+    if (cache_init (cache_basedir) < 0) {
         err (1, "Could not create cache dir");
     }
+    cache_set_soft_ttl (soft_ttl);
+    cache_set_durability (durability);
+    cache_set_dedup (dedup);
     fprintf (stdout, "proc %d: Initialized cache...\n", index);
 
     /* initialize epoll */
@@ -396,16 +1460,29 @@ child (const int8_t index, const uint8_t *server_port)
 
     /* add epoll event for handling listen socket */
     struct command *lcmd = calloc (1, sizeof (struct command));
+    lcmd->cmd = LISTEN;
     lcmd->cfd = listensock;
-    epoll_add (epollfd, lcmd);
+    epoll_add (lcmd);
 
     /* event buffer */
     events = calloc (MAXEVENTS, sizeof (event));
 
+    /* deadlines for clients and remote hosts */
+    timer_wheel_init (&wheel, timer_clock ());
+
     fprintf (stdout, "proc %d: Entering main loop...\n", index);
+    __atomic_store_n (&loads[index].ready, 1, __ATOMIC_RELAXED);
     for (;;) {
-        /* block until we get some events to process */
-        int numevents = epoll_wait (epollfd, events, MAXEVENTS, -1);
+        int timeout = timer_wheel_timeout (&wheel);
+
+        /* check on draining at least once a second */
+        if (draining && ((timeout < 0) || (timeout > 1000))) {
+            timeout = 1000;
+        }
+
+        /* block until we get some events to process or a deadline passes */
+        int numevents = epoll_wait (epollfd, events, MAXEVENTS, timeout);
+        uint64_t start = clock_ns ();
         struct command *command;
 
         /* process all events */
@@ -413,20 +1490,28 @@ child (const int8_t index, const uint8_t *server_port)
             /* get command */
             command = events[i].data.ptr;
 
+            /* closed by an earlier event */
+            if (!command->cmd) {
+                continue;
+            }
+
             /* epoll error */
             if ((events[i].events & EPOLLERR) ||
                 (events[i].events & EPOLLHUP) ||
-                (!(events[i].events & EPOLLIN)))
+                (!(events[i].events & (EPOLLIN | EPOLLOUT))))
             {
                 /* notified but nothing ready for processing */
-                warn ("epoll error");
-                close (command->cfd);
-                close (command->rfd);
+                warnx ("epoll error");
+                if (command->cmd & (READ_REMOTE | CONNECT_REMOTE)) {
+                    remote_failed (command);
+                } else {
+                    drop_command (command);
+                }
                 continue;
             }
             /* ACCEPT */
-            else if (command->cfd == listensock) {
-                do_accept (listensock, epollfd);
+            else if (command == lcmd) {
+                do_accept (listensock);
                 /* processed all incoming events on listensock, continue to
                  * next event. */
                 continue;
@@ -435,23 +1520,16 @@ child (const int8_t index, const uint8_t *server_port)
             else {
                 switch (command->cmd) {
                     case READ_CMD:
-                        do_read_cmd (epollfd, command);
+                        do_client (command, events[i].events);
+                        break;
+
+                    case CONNECT_REMOTE:
+                        do_connect_remote (command);
                         break;
 
                     case READ_REMOTE:
-                        ;   /* hack needed for variable defs inside switch */
-                        uint8_t buf[BUFLEN] = { 0 };
-                        ssize_t buflen;
                         /* command is free'd in d_r_r() */
-                        int cfd = command->cfd;
-
-                        do_read_remote (command, buf, &buflen);
-                        /* verify that we actually have data to relay back */
-                        if (buflen > 0) {
-                            if (!sendall (cfd, buf, (size_t *) &buflen)) {
-                                warn ("Could not relay back data to client");
-                            }
-                        }
+                        do_read_remote (command);
                         break;
 
                     default:
@@ -459,28 +1537,282 @@ child (const int8_t index, const uint8_t *server_port)
                 }
             }
         }
+
+        /* reclaim idle clients and stuck remote hosts */
+        timer_wheel_advance (&wheel, timer_clock ());
+
+        free_released ();
+
+        if (trace_requested) {
+            do_trace_dump ();
+        }
+
+        publish_load (&loads[index], clock_ns () - start);
+
+        if (draining) {
+            if (lcmd) {
+                /* connections still queued would be reset on close */
+                do_accept (listensock);
+                close (listensock);     /* also removes from epoll */
+                free (lcmd);
+                lcmd = NULL;
+                drain_deadline = timer_clock () + DRAIN_TIMEOUT * 1000;
+            }
+
+            if (!ncommands || timer_clock () >= drain_deadline) {
+                break;
+            }
+        }
     }
 
     free (events);
-    close (listensock);
 
     return EXIT_SUCCESS;
 }
 
 
 /**
- * Signal handler, exits on SIGINT.
+ * Signal handler, exits on SIGINT, drains workers and exits on SIGTERM and
+ * has workers dump their trace on SIGUSR1.
  */
 static void
 sighandler (int signal)
 {
-    if (signal == SIGINT) {
-        for (int i = 0; i < NUMCHILDS; i++) {
-            if (child_pids[i] != 0) {
-                kill (child_pids[i], SIGKILL);
+    if ((signal != SIGINT) && (signal != SIGTERM) && (signal != SIGUSR1)) {
+        return;
+    }
+
+    if (signal != SIGUSR1) {
+        quitting = 1;
+    }
+
+    for (int i = 0; i < numchilds; i++) {
+        pid_t pid = child_pids[i] < 0 ? -child_pids[i] : child_pids[i];
+
+        if (pid != 0) {
+            kill (pid, signal == SIGINT ? SIGKILL : signal);
+        }
+    }
+}
+
+
+/**
+ * Fork a worker into free slot "index".
+ */
+static void
+spawn_worker (const int index, const uint8_t *server_port)
+{
+    pid_t pid;
+
+    loads[index].busy_ns = 0;
+    loads[index].commands = 0;
+    loads[index].ready = 0;
+    child_started[index] = timer_clock ();
+    child_restart[index] = 0;
+
+    /* do not let the worker inherit buffered output */
+    fflush (stdout);
+
+    if ((pid = fork ()) == 0) {
+        /* a worker supervises nobody */
+        numchilds = 0;
+        exit (child (index, server_port));
+    } else if (pid < 0) {
+        warn ("fork");
+        return;
+    }
+
+    child_pids[index] = pid;
+}
+
+
+/**
+ * Reap exited workers, restart those that were not asked to retire.
+ *
+ * A worker that dies within RESTART_QUICK seconds is restarted after a
+ * delay doubling from a second, and given up on after RESTART_MAX such
+ * deaths in a row. A worker that never got to its event loop cannot be set
+ * up, and is given up on right away. A given up slot is not used again.
+ *
+ * Returns the number of workers running, retiring or waiting for their
+ * restart.
+ */
+static int
+reap_workers (const uint8_t *server_port)
+{
+    uint64_t    now = timer_clock ();
+    pid_t       pid;
+    int         status,
+                alive = 0;
+
+    while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < numchilds; i++) {
+            if (child_pids[i] == -pid) {
+                /* retired */
+                child_pids[i] = 0;
+            } else if (child_pids[i] == pid) {
+                child_pids[i] = 0;
+                if (quitting) {
+                    continue;
+                }
+
+                if (!__atomic_load_n (&loads[i].ready, __ATOMIC_RELAXED)) {
+                    child_failures[i] = RESTART_MAX + 1;
+                } else if (now - child_started[i] < RESTART_QUICK * 1000) {
+                    child_failures[i]++;
+                } else {
+                    child_failures[i] = 0;
+                }
+
+                if (child_failures[i] > RESTART_MAX) {
+                    warnx ("worker %d (pid %d) died, giving up on it", i, pid);
+                } else if (child_failures[i]) {
+                    warnx ("worker %d (pid %d) died, restarting in %d s", i,
+                           pid, 1 << (child_failures[i] - 1));
+                    child_restart[i] = now +
+                                       (1000 << (child_failures[i] - 1));
+                } else {
+                    warnx ("worker %d (pid %d) died, restarting", i, pid);
+                    spawn_worker (i, server_port);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < numchilds; i++) {
+        if (!quitting && child_restart[i] && (now >= child_restart[i])) {
+            spawn_worker (i, server_port);
+        }
+        alive += (child_pids[i] != 0) || (child_restart[i] != 0);
+    }
+
+    return alive;
+}
+
+
+/**
+ * Supervise workers until told to quit.
+ *
+ * Dead workers are restarted, see reap_workers(), and supervising ends
+ * with a failure once none is left. Once per SUPERVISE_INTERVAL the load the
+ * workers publish is checked: a worker is added when they are busy
+ * handling events more than SCALE_UP_BUSY % of the time, or have more than
+ * SCALE_UP_QUEUE commands open each, and one is retired when they have
+ * been below SCALE_DOWN_BUSY % for SCALE_DOWN_CHECKS checks in a row. The
+ * number of workers stays between "min" and the number of slots.
+ */
+static int
+supervise (const uint8_t *server_port, const int min)
+{
+    uint64_t    *busy_prev = calloc (numchilds, sizeof (uint64_t)),
+                now,
+                prev = timer_clock ();
+    int         quiet = 0;
+
+    while (!quitting) {
+        uint64_t    busy = 0,
+                    commands = 0;
+        int         active = 0,
+                    free_slot = -1,
+                    last = -1,
+                    percent;
+
+        sleep (SUPERVISE_INTERVAL);
+        if (!reap_workers (server_port) && !quitting) {
+            warnx ("no worker left, exiting");
+            free (busy_prev);
+            return EXIT_FAILURE;
+        }
+        if (quitting) {
+            break;
+        }
+
+        now = timer_clock ();
+        for (int i = 0; i < numchilds; i++) {
+            uint64_t b = __atomic_load_n (&loads[i].busy_ns,
+                                          __ATOMIC_RELAXED);
+
+            if (child_pids[i] > 0) {
+                /* restarted workers count from zero again */
+                busy += b >= busy_prev[i] ? b - busy_prev[i] : b;
+                commands += __atomic_load_n (&loads[i].commands,
+                                             __ATOMIC_RELAXED);
+                active++;
+                last = i;
+            } else if (!child_pids[i] && !child_restart[i] &&
+                       (child_failures[i] <= RESTART_MAX) && (free_slot < 0)) {
+                free_slot = i;
+            }
+            busy_prev[i] = b;
+        }
+
+        if (!active || now == prev) {
+            prev = now;
+            continue;
+        }
+        percent = busy / 10000 / (now - prev) / active;
+        prev = now;
+
+        if (free_slot >= 0 &&
+            ((percent > SCALE_UP_BUSY) ||
+             (commands > (uint64_t) SCALE_UP_QUEUE * active)))
+        {
+            warnx ("load %d%%, %lu commands, adding worker %d", percent,
+                   (unsigned long) commands, free_slot);
+            spawn_worker (free_slot, server_port);
+            quiet = 0;
+        } else if ((percent < SCALE_DOWN_BUSY) && (active > min)) {
+            if (++quiet >= SCALE_DOWN_CHECKS) {
+                warnx ("load %d%%, retiring worker %d", percent, last);
+                kill (child_pids[last], SIGTERM);
+                child_pids[last] = -child_pids[last];
+                quiet = 0;
             }
+        } else {
+            quiet = 0;
         }
     }
+
+    free (busy_prev);
+
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Print usage and exit.
+ */
+static void
+usage (const char *progname)
+{
+    fprintf (stderr,
+             "usage: %s [-i idle] [-c connect] [-r read] [-t ttl] [-y sync]\n"
+             "             [-d cachedir] [-D] [-k keys] [-s self -p peer ...]\n"
+             "             [-m min] [-M max] [port [processes]]\n"
+             "\n"
+             "  -d cachedir cache directory, default " CACHE_BASEDIR "\n"
+             "  -D          store identical cache contents only once\n"
+             "  -k keys     cache services under one key however they are\n"
+             "              named: name (lower case host, numeric port) or\n"
+             "              addr (IPv4 address, numeric port)\n"
+             "  -t ttl      refresh cache entries older than ttl seconds in\n"
+             "              the background, while still serving them\n"
+             "  -y sync     sync cache writes to disk: none, data or full\n"
+             "              (default)\n"
+             "  -s self     this node's addr:port in a cluster of peers\n"
+             "  -p peer     addr:port of a peer node, may be repeated\n"
+             "  -i idle     close idle client connections after idle seconds\n"
+             "  -c connect  give up connecting to remote host after connect\n"
+             "              seconds\n"
+             "  -r read     give up waiting for remote host data after read\n"
+             "              seconds\n"
+             "  -m min      scale down to no fewer than min processes\n"
+             "  -M max      scale up to no more than max processes\n"
+             "\n"
+             "A timeout of 0 disables the deadline. Without -m and -M the\n"
+             "number of processes is fixed.\n",
+             progname);
+    exit (EXIT_FAILURE);
 }
 
 
@@ -491,17 +1823,106 @@ int
 main (int argc, char *argv[])
 {
     int             status,
-                    numchilds;
+                    exitcode,
+                    opt;
 
     uint8_t         *server_port;
 
+    char            *progname = argv[0];
+
+    int             npeers = 0,
+                    nselves = 0,
+                    nworkers,
+                    min = 0,
+                    max = 0;
+
 
     signal (SIGINT, sighandler);
+    signal (SIGTERM, sighandler);
+    signal (SIGUSR1, sighandler);
+
+    /* options, positional arguments follow */
+    while ((opt = getopt (argc, argv, "i:c:r:t:y:d:Dk:s:p:m:M:")) != -1) {
+        switch (opt) {
+            case 'd':
+                cache_basedir = (const uint8_t *) optarg;
+                break;
+
+            case 'D':
+                dedup = 1;
+                break;
+
+            case 'k':
+                if (!strcmp (optarg, "name")) {
+                    key_mode = CANON_NAME;
+                } else if (!strcmp (optarg, "addr")) {
+                    key_mode = CANON_ADDR;
+                } else {
+                    usage (progname);
+                }
+                break;
+
+            case 't':
+                soft_ttl = strtoul (optarg, NULL, 10);
+                break;
+
+            case 'y':
+                if (!strcmp (optarg, "none")) {
+                    durability = CACHE_SYNC_NONE;
+                } else if (!strcmp (optarg, "data")) {
+                    durability = CACHE_SYNC_DATA;
+                } else if (!strcmp (optarg, "full")) {
+                    durability = CACHE_SYNC_FULL;
+                } else {
+                    usage (progname);
+                }
+                break;
+
+            case 's':
+            case 'p':
+                if (peer_add ((const uint8_t *) optarg, opt == 's') < 0) {
+                    err (1, "Could not add peer %s", optarg);
+                }
+                npeers += opt == 'p';
+                nselves += opt == 's';
+                break;
+
+            case 'i':
+                idle_timeout = strtoul (optarg, NULL, 10) * 1000;
+                break;
+
+            case 'c':
+                connect_timeout = strtoul (optarg, NULL, 10) * 1000;
+                break;
+
+            case 'r':
+                read_timeout = strtoul (optarg, NULL, 10) * 1000;
+                break;
+
+            case 'm':
+                min = atoi (optarg);
+                break;
+
+            case 'M':
+                max = atoi (optarg);
+                break;
+
+            default:
+                usage (progname);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    /* a cluster needs to know which of its members this node is */
+    if ((npeers && nselves != 1) || nselves > 1) {
+        usage (progname);
+    }
 
     /* get (valid) port from command line or use default port */
     if ((argc >= 2) && (atoi (argv[1]) < 65536)) {
         size_t portlen = strlen (argv[1]);
-        server_port = calloc (1, portlen);
+        server_port = calloc (1, portlen + 1);
         strncat ((char *) server_port, argv[1], portlen);
     } else {
         server_port = calloc (1, 5);
@@ -510,31 +1931,50 @@ main (int argc, char *argv[])
 
     /* get user defined number of concurrent processes */
     if ((argc >= 3) && (atoi (argv[2]) < sysconf (_SC_CHILD_MAX))) {
-        numchilds = atoi(argv[2]);
+        nworkers = atoi(argv[2]);
     } else {
-        numchilds = NUMCHILDS;
+        nworkers = NUMCHILDS;
     }
 
-    child_pids = calloc (numchilds, sizeof (pid_t));
+    /* scale between min and max, start within them */
+    if (!max) {
+        max = min > nworkers ? min : nworkers;
+    }
+    if (!min) {
+        min = max < nworkers ? max : nworkers;
+    }
+    if ((min < 1) || (min > max) || (max >= sysconf (_SC_CHILD_MAX))) {
+        usage (progname);
+    }
+    nworkers = nworkers < min ? min : (nworkers > max ? max : nworkers);
 
-    for (int8_t i = 0; i < numchilds; i++) {
-        pid_t pid = fork ();
+    /* a slot per worker there may ever be */
+    numchilds = max;
+    child_pids = calloc (numchilds, sizeof (pid_t));
+    child_started = calloc (numchilds, sizeof (uint64_t));
+    child_restart = calloc (numchilds, sizeof (uint64_t));
+    child_failures = calloc (numchilds, sizeof (int));
+    loads = mmap (NULL, numchilds * sizeof (struct worker_load),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (loads == MAP_FAILED) {
+        err (1, "Could not map worker load");
+    }
 
-        if (pid == 0) {
-            child (i, server_port);
-            return EXIT_SUCCESS;
-        }
-        else if (pid < 0) {
-            err (1, "fork");
-        } else {
-            /* parent process saves child pids */
-            child_pids[i] = pid;
-        }
+    for (int i = 0; i < nworkers; i++) {
+        spawn_worker (i, server_port);
     }
 
-    wait (&status);
+    exitcode = supervise (server_port, min);
+
+    /* wait for the workers to finish */
+    while ((wait (&status) > 0) || (errno == EINTR)) {
+        ;
+    }
 
     free (child_pids);
+    free (child_started);
+    free (child_restart);
+    free (child_failures);
 
-    return EXIT_SUCCESS;
+    return exitcode;
 }
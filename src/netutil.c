@@ -118,3 +118,52 @@ sendall (const int socket, const uint8_t *buf, size_t *buflen)
 
     return sentbytes != -1;
 }
+
+
+/**
+ * Gather write all of iov to socket. The iov array is consumed in the
+ * process.
+ *
+ * Returns number of bytes written, which is short of the total when a
+ * non-blocking socket would block, or -1 on error.
+ */
+ssize_t
+writevall (const int socket, struct iovec *iov, int iovcnt)
+{
+    ssize_t     numbytes,
+                sentbytes = 0;
+
+    while (iovcnt > 0) {
+        if ((numbytes = writev (socket, iov, iovcnt)) < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            return -1;
+        }
+        sentbytes += numbytes;
+
+        /* skip fully written buffers, adjust partially written one */
+        while (iovcnt > 0 && (size_t) numbytes >= iov->iov_len) {
+            numbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + numbytes;
+            iov->iov_len -= numbytes;
+        }
+    }
+
+    return sentbytes;
+}
+
+
+/**
+ * Toggle TCP_CORK on socket. While corked, partial frames are held back so
+ * that consecutive writes leave as full segments, uncorking flushes them.
+ */
+int
+sock_cork (const int socket, const int cork)
+{
+    return setsockopt (socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof (int));
+}
@@ -4,6 +4,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,6 +13,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
@@ -19,3 +22,8 @@ extern int mk_nonblock (const int socket);
 extern int setup_listener(const uint8_t * server_port);
 
 extern int sendall (const int socket, const uint8_t * buf, size_t * buflen);
+
+extern ssize_t writevall (const int socket, struct iovec * iov,
+                          int iovcnt);
+
+extern int sock_cork (const int socket, const int cork);
@@ -0,0 +1,82 @@
+/**
+ * Parsing of client commands, split out of the main server program so that
+ * it can be exercised on its own.
+ */
+
+#include "parse.h"
+
+
+/**
+ * Extract remote host and port from remote service string.
+ */
+int
+extract_host_port (const uint8_t *remote_srv, const ssize_t len,
+                     uint8_t *remote_host, uint8_t *remote_port)
+{
+    uint8_t *s, *h, *p;
+
+    s = h = (uint8_t *) strndup ((char *) remote_srv, len);
+    s += len;
+    /* search for ':' from the back of supplied string, stop when we searched
+     * through everything. */
+    for (; (*(--s) != ':') && (s != h) ;);
+
+    if (s == h) {
+        warnx ("Invalid argument %s", h);
+        free (h);
+        return -1;
+    }
+
+    /* split supplied string into host and port */
+    *s = '\0';
+    p = s + 1;
+
+    /* "return values", remote host and port */
+    strncat ((char *) remote_host, (char *) h, strlen ((char *) h));
+    strncat ((char *) remote_port, (char *) p, strlen ((char *) p));
+
+    free (h);
+
+    return 1;
+}
+
+
+/**
+ * Extract commands from client buffer.
+ *
+ * The function dynamically allocates a memory region for the parsed result.
+ */
+uint8_t**
+extract_cmds (const uint8_t *buf)
+{
+    uint8_t     num = 0;
+    uint8_t     **cmds = calloc (1, SERVMAXLEN);
+
+
+    /* split on newlines, allow commands with only \n as well as \r\n */
+    uint8_t     *tok = (uint8_t *) strtok ((char *) buf, "\n");
+
+    /* extract each command from user input */
+    for (;;) {
+        /* exhausted input buffer */
+        if (!tok) {
+            cmds[num++] = NULL;
+            break;
+        }
+
+        /* remove possible carriage return */
+        uint8_t *cr;
+        if ((cr = (uint8_t *) strrchr ((char *) tok, '\r')) != NULL) {
+            *cr = '\0';
+        }
+
+        /* duplicate and save command if it exists */
+        cmds[num++] = tok ? (uint8_t *) strdup ((char *) tok) : tok;
+
+        /* alloc place for another command */
+        cmds = realloc (cmds, (num + 2) * SERVMAXLEN);
+        tok = (uint8_t *) strtok (NULL, "\n");
+    }
+
+    return cmds;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <err.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+
+#define SERVMAXLEN          NI_MAXHOST + NI_MAXSERV + 1   /* "addr:port" */
+
+
+extern int extract_host_port (const uint8_t * remote_srv, const ssize_t len,
+                              uint8_t * remote_host, uint8_t * remote_port);
+
+extern uint8_t ** extract_cmds (const uint8_t * buf);
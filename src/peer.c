@@ -0,0 +1,134 @@
+/**
+ * Consistent hashing of cache keys onto a cluster of Ombud nodes.
+ *
+ * Every node, this one included, is identified by its "addr:port" and placed
+ * PEER_VNODES times on a hash ring. A key is owned by the first node found on
+ * the ring at or after the hash of the key, so adding or removing a node only
+ * moves the keys next to it. All nodes must be configured with the same set of
+ * members for them to agree on owners.
+ */
+
+#include "peer.h"
+
+
+struct vnode {
+    uint64_t    point;      /* position on ring */
+    size_t      member;     /* index into members */
+};
+
+
+static uint8_t      **members;
+static size_t       nmembers;
+static size_t       self_member = (size_t) -1;
+
+static struct vnode *ring;
+static size_t       nvnodes;
+
+
+/*******************************************************************************
+ *
+ *  Internal helper functions
+ *
+ ******************************************************************************/
+
+/**
+ * Order virtual nodes by ring position.
+ */
+static int
+vnode_cmp (const void * a, const void * b)
+{
+    const struct vnode *va = a,
+                       *vb = b;
+
+    return (va->point > vb->point) - (va->point < vb->point);
+}
+
+
+/*******************************************************************************
+ *
+ *  API
+ *
+ ******************************************************************************/
+
+/**
+ * Add cluster member "id" ("addr:port") to the ring, "self" marks the member
+ * that is this node.
+ */
+int
+peer_add (const uint8_t * id, const int self)
+{
+    uint8_t     vnode_id[BUFSIZ];
+    void        *p;
+
+    if ((p = realloc (members, (nmembers + 1) * sizeof (*members))) == NULL) {
+        return -1;
+    }
+    members = p;
+
+    if ((p = realloc (ring, (nvnodes + PEER_VNODES) * sizeof (*ring))) == NULL) {
+        return -1;
+    }
+    ring = p;
+
+    if ((members[nmembers] = (uint8_t *) strdup ((char *) id)) == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < PEER_VNODES; i++) {
+        int len = snprintf ((char *) vnode_id, sizeof (vnode_id), "%s#%zu",
+                            (char *) id, i);
+
+        ring[nvnodes].point = hash64 (vnode_id, len);
+        ring[nvnodes].member = nmembers;
+        nvnodes++;
+    }
+
+    if (self) {
+        self_member = nmembers;
+    }
+    nmembers++;
+
+    qsort (ring, nvnodes, sizeof (*ring), vnode_cmp);
+
+    return 0;
+}
+
+
+/**
+ * Find the member owning "key".
+ *
+ * Returns the "addr:port" of the owner, or NULL if this node owns the key or
+ * no cluster is configured.
+ */
+const uint8_t *
+peer_owner (const uint8_t * key)
+{
+    uint64_t    h;
+    size_t      lo = 0,
+                hi = nvnodes;
+
+    if (nmembers < 2) {
+        return NULL;
+    }
+
+    /* first virtual node at or after the key hash, wrapping around */
+    h = hash64 (key, strlen ((char *) key));
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (ring[mid].point < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == nvnodes) {
+        lo = 0;
+    }
+
+    if (ring[lo].member == self_member) {
+        return NULL;
+    }
+
+    return members[ring[lo].member];
+}
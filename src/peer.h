@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+
+#define PEER_VNODES     64      /* points per node on the hash ring */
+
+
+extern int peer_add (const uint8_t * id, const int self);
+
+extern const uint8_t * peer_owner (const uint8_t * key);
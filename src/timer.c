@@ -0,0 +1,277 @@
+/**
+ * Hierarchical timing wheel.
+ *
+ * Timers are kept in TIMER_LEVELS wheels of TIMER_SLOTS slots each. Level 0
+ * has a resolution of one tick, every level above is TIMER_SLOTS times
+ * coarser. Timers far in the future are placed on a high level and cascaded
+ * down to lower levels as the wheel turns, so adding, removing and expiring
+ * a timer are all O(1). A bitmap per level keeps track of non-empty slots,
+ * which makes it cheap to find out how long epoll_wait(2) may sleep.
+ */
+
+#include "timer.h"
+
+
+/*******************************************************************************
+ *
+ *  Internal helper functions
+ *
+ ******************************************************************************/
+
+/**
+ * Distance from slot "from" to the first non-empty slot in bitmap "used",
+ * wrapping around the end of the wheel.
+ */
+static unsigned int
+slot_distance (const uint64_t used, const unsigned int from)
+{
+    uint64_t rotated = used >> from;
+
+    if (from) {
+        rotated |= used << (TIMER_SLOTS - from);
+    }
+
+    return __builtin_ctzll (rotated);
+}
+
+
+/**
+ * Link timer into the slot matching its expiry time.
+ */
+static void
+wheel_link (struct timer_wheel * tw, struct timer * t)
+{
+    uint64_t        diff = t->expires - tw->now;
+    unsigned int    level = 0,
+                    idx;
+    struct timer    *head;
+
+    while ((level < TIMER_LEVELS - 1) &&
+           (diff >> (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+
+    /* beyond the range of the wheel, clamp to the last tick of it */
+    if (diff >> (TIMER_BITS * TIMER_LEVELS)) {
+        t->expires = tw->now + (1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    idx = (t->expires >> (TIMER_BITS * level)) & TIMER_MASK;
+    head = &tw->slots[level][idx];
+
+    t->slot = level * TIMER_SLOTS + idx;
+    t->prev = head;
+    t->next = head->next;
+    head->next->prev = t;
+    head->next = t;
+
+    tw->used[level] |= 1ULL << idx;
+    tw->count++;
+}
+
+
+/**
+ * Unlink timer from its slot.
+ */
+static void
+wheel_unlink (struct timer_wheel * tw, struct timer * t)
+{
+    unsigned int    level = t->slot / TIMER_SLOTS,
+                    idx = t->slot % TIMER_SLOTS;
+    struct timer    *head = &tw->slots[level][idx];
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+
+    if (head->next == head) {
+        tw->used[level] &= ~(1ULL << idx);
+    }
+    tw->count--;
+}
+
+
+/**
+ * Earliest tick at which there is something to expire or cascade, 0 if the
+ * wheel is empty.
+ */
+static uint64_t
+wheel_next_tick (const struct timer_wheel * tw)
+{
+    uint64_t next = 0;
+
+    if (!tw->count) {
+        return 0;
+    }
+
+    for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+        unsigned int    shift = TIMER_BITS * level;
+        uint64_t        block = tw->now >> shift,
+                        tick;
+
+        if (!tw->used[level]) {
+            continue;
+        }
+
+        block += 1 + slot_distance (tw->used[level],
+                                    (block + 1) & TIMER_MASK);
+        tick = block << shift;
+
+        if (!next || tick < next) {
+            next = tick;
+        }
+    }
+
+    return next;
+}
+
+
+/**
+ * Process a single tick: cascade higher levels down and run expired timers.
+ */
+static void
+wheel_tick (struct timer_wheel * tw)
+{
+    struct timer *head;
+
+    /* cascade from the top, entries may fall through several levels */
+    for (unsigned int level = TIMER_LEVELS - 1; level > 0; level--) {
+        unsigned int shift = TIMER_BITS * level;
+
+        if (tw->now & ((1ULL << shift) - 1)) {
+            continue;
+        }
+
+        head = &tw->slots[level][(tw->now >> shift) & TIMER_MASK];
+        while (head->next != head) {
+            struct timer *t = head->next;
+
+            wheel_unlink (tw, t);
+            wheel_link (tw, t);
+        }
+    }
+
+    /* expire, callbacks are free to add and delete timers */
+    head = &tw->slots[0][tw->now & TIMER_MASK];
+    while (head->next != head) {
+        struct timer *t = head->next;
+
+        wheel_unlink (tw, t);
+        t->cb (t);
+    }
+}
+
+
+/*******************************************************************************
+ *
+ *  API
+ *
+ ******************************************************************************/
+
+/**
+ * Current monotonic time in milliseconds.
+ */
+uint64_t
+timer_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Initialize an empty timer wheel starting at "now_ms".
+ */
+void
+timer_wheel_init (struct timer_wheel * tw, const uint64_t now_ms)
+{
+    tw->now = now_ms / TIMER_TICK_MS;
+    tw->count = 0;
+
+    for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+        tw->used[level] = 0;
+        for (unsigned int idx = 0; idx < TIMER_SLOTS; idx++) {
+            tw->slots[level][idx].next = &tw->slots[level][idx];
+            tw->slots[level][idx].prev = &tw->slots[level][idx];
+        }
+    }
+}
+
+
+/**
+ * Arm timer "t" to fire in "timeout_ms" milliseconds. An already armed timer
+ * is re-armed.
+ *
+ * The deadline is relative to the clock rather than to the last tick the
+ * wheel processed, which may lag behind after a long epoll_wait(2).
+ */
+void
+timer_add (struct timer_wheel * tw, struct timer * t, const uint64_t timeout_ms)
+{
+    uint64_t now = timer_clock () / TIMER_TICK_MS,
+             ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    timer_del (tw, t);
+
+    if (now < tw->now) {
+        now = tw->now;
+    }
+
+    t->expires = now + (ticks ? ticks : 1);
+    wheel_link (tw, t);
+}
+
+
+/**
+ * Disarm timer "t", it is fine to call this for timers that are not armed.
+ */
+void
+timer_del (struct timer_wheel * tw, struct timer * t)
+{
+    if (t->next) {
+        wheel_unlink (tw, t);
+    }
+}
+
+
+/**
+ * Milliseconds until the wheel needs to be advanced, -1 if no timers are
+ * armed. Suitable as timeout for epoll_wait(2).
+ */
+int
+timer_wheel_timeout (const struct timer_wheel * tw)
+{
+    uint64_t next = wheel_next_tick (tw);
+
+    if (!next) {
+        return -1;
+    }
+
+    return (next - tw->now) * TIMER_TICK_MS;
+}
+
+
+/**
+ * Advance the wheel to "now_ms", running the callbacks of all timers that
+ * expired on the way. Ticks without any work are skipped.
+ */
+void
+timer_wheel_advance (struct timer_wheel * tw, const uint64_t now_ms)
+{
+    uint64_t target = now_ms / TIMER_TICK_MS;
+
+    while (tw->now < target) {
+        uint64_t next = wheel_next_tick (tw);
+
+        if (!next || next > target) {
+            tw->now = target;
+            break;
+        }
+
+        tw->now = next;
+        wheel_tick (tw);
+    }
+}
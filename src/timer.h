@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+#define TIMER_TICK_MS   10                  /* wheel resolution */
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)   /* slots per level */
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_LEVELS    4                   /* 64^4 ticks, ~46 hours */
+
+
+struct timer {
+    struct timer    *next;      /* slot list, NULL when not armed */
+    struct timer    *prev;
+    uint64_t        expires;    /* absolute tick */
+    unsigned int    slot;       /* level * TIMER_SLOTS + slot index */
+    void            (*cb) (struct timer *);
+    void            *data;
+};
+
+struct timer_wheel {
+    uint64_t        now;        /* last processed tick */
+    size_t          count;      /* armed timers */
+    uint64_t        used[TIMER_LEVELS];     /* non-empty slot bitmaps */
+    struct timer    slots[TIMER_LEVELS][TIMER_SLOTS];   /* list heads */
+};
+
+
+extern uint64_t timer_clock (void);
+
+extern void timer_wheel_init (struct timer_wheel * tw, const uint64_t now_ms);
+
+extern void timer_add (struct timer_wheel * tw, struct timer * t,
+                       const uint64_t timeout_ms);
+
+extern void timer_del (struct timer_wheel * tw, struct timer * t);
+
+extern int timer_wheel_timeout (const struct timer_wheel * tw);
+
+extern void timer_wheel_advance (struct timer_wheel * tw,
+                                 const uint64_t now_ms);
@@ -0,0 +1,138 @@
+/**
+ * Per process request tracing.
+ *
+ * Timestamped phase events of every request are recorded in a ring buffer
+ * that keeps the latest TRACE_EVENTS events. Recording is a clock_gettime(2)
+ * through the vDSO and a store, cheap enough to always be on. Each process
+ * is the only writer of its own ring, so no locking is needed; a dump is
+ * requested with a signal and written from the event loop, never from the
+ * signal handler.
+ *
+ * Dumps are in the Chrome trace event format, to be opened in e.g. Perfetto
+ * or chrome://tracing. Every request gets a row of its own, each phase is
+ * drawn as a span from the previous phase of the request.
+ */
+
+#include "trace.h"
+
+
+static const char *phase_names[] = {
+    "accepted", "parsed", "cache lookup", "resolve", "connect",
+    "first byte", "cache write", "last byte sent"
+};
+
+static struct trace_event   ring[TRACE_EVENTS];
+static uint64_t             head;           /* events ever recorded */
+static uint32_t             next_request;
+
+
+/*******************************************************************************
+ *
+ *  Internal helper functions
+ *
+ ******************************************************************************/
+
+/**
+ * Order events by request, then by time.
+ */
+static int
+event_cmp (const void * a, const void * b)
+{
+    const struct trace_event    *ea = a,
+                                *eb = b;
+
+    if (ea->req != eb->req) {
+        return (ea->req > eb->req) - (ea->req < eb->req);
+    }
+
+    return (ea->ns > eb->ns) - (ea->ns < eb->ns);
+}
+
+
+/*******************************************************************************
+ *
+ *  API
+ *
+ ******************************************************************************/
+
+/**
+ * Allocate a new request (or connection) id.
+ */
+uint32_t
+trace_request (void)
+{
+    return ++next_request;
+}
+
+
+/**
+ * Record that request "req" reached "phase".
+ */
+void
+trace (const uint32_t req, const uint8_t phase, const uint32_t arg)
+{
+    struct trace_event  *event = &ring[head & (TRACE_EVENTS - 1)];
+    struct timespec     ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    event->ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    event->req = req;
+    event->arg = arg;
+    event->phase = phase;
+
+    head++;
+}
+
+
+/**
+ * Write recorded events to "path" as a Chrome trace.
+ */
+int
+trace_dump (const char * path)
+{
+    struct trace_event  *events;
+    size_t              nevents = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+    FILE                *fp;
+    pid_t               pid = getpid ();
+
+    /* work on a copy, the ring keeps recording */
+    if ((events = malloc (nevents * sizeof (*events))) == NULL) {
+        return -1;
+    }
+    memcpy (events, ring, nevents * sizeof (*events));
+    qsort (events, nevents, sizeof (*events), event_cmp);
+
+    if ((fp = fopen (path, "w")) == NULL) {
+        free (events);
+        return -1;
+    }
+
+    fprintf (fp, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < nevents; i++) {
+        struct trace_event *e = &events[i];
+
+        fprintf (fp, "%s{\"name\":\"%s\",\"pid\":%d,\"tid\":%u,",
+                 i ? "," : "", phase_names[e->phase], pid, e->req);
+
+        if (i && (events[i - 1].req == e->req)) {
+            /* span since previous phase of the same request */
+            fprintf (fp, "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f",
+                     events[i - 1].ns / 1000.0,
+                     (e->ns - events[i - 1].ns) / 1000.0);
+        } else {
+            fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f",
+                     e->ns / 1000.0);
+        }
+
+        if (e->phase == TRACE_PARSED) {
+            fprintf (fp, ",\"args\":{\"conn\":%u}", e->arg);
+        }
+        fprintf (fp, "}\n");
+    }
+    fprintf (fp, "]}\n");
+
+    free (events);
+
+    return fclose (fp);
+}
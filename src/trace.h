@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define TRACE_EVENTS        4096    /* events kept per process, power of 2 */
+
+/* request phases */
+#define TRACE_ACCEPTED      0       /* client connection accepted */
+#define TRACE_PARSED        1       /* command parsed */
+#define TRACE_LOOKUP        2       /* cache lookup done */
+#define TRACE_RESOLVE       3       /* remote host resolved */
+#define TRACE_CONNECT       4       /* connected to remote host */
+#define TRACE_FIRST_BYTE    5       /* remote host data read */
+#define TRACE_CACHE_WRITE   6       /* remote host data cached */
+#define TRACE_LAST_BYTE     7       /* response sent to client */
+
+
+struct trace_event {
+    uint64_t    ns;         /* CLOCK_MONOTONIC */
+    uint32_t    req;        /* request, or connection, id */
+    uint32_t    arg;        /* connection id of parsed command */
+    uint8_t     phase;
+};
+
+
+extern uint32_t trace_request (void);
+
+extern void trace (const uint32_t req, const uint8_t phase,
+                   const uint32_t arg);
+
+extern int trace_dump (const char * path);
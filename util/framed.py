@@ -0,0 +1,45 @@
+# Pipeline commands over one connection using the framed protocol
+
+import socket
+import struct
+import sys
+
+STATUS = {0: "ok", 1: "hit", 2: "miss", 3: "error"}
+
+
+def recv_exactly(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("connection closed")
+        data += chunk
+    return data
+
+
+def recv_frame(sock):
+    rid, status, length = struct.unpack("!IBI", recv_exactly(sock, 9))
+    return rid, STATUS[status], recv_exactly(sock, length)
+
+
+sock = socket.socket()
+sock.settimeout(15)
+sock.connect(("localhost", 8090))
+
+# negotiate framed mode
+sock.sendall(b"FRAMED\r\n")
+print(recv_frame(sock))
+
+cmds = ["localhost:22", "127.0.0.1:22", "localhost:9999", "127.0.0.1:9999"]
+frames = b""
+for rid, cmd in enumerate(cmds * 4):
+    key = cmd.encode()
+    frames += struct.pack("!IH", rid, len(key)) + key
+sock.sendall(frames)
+
+# responses carry request ids, misses may arrive after later hits
+for _ in range(len(cmds) * 4):
+    rid, status, payload = recv_frame(sock)
+    sys.stdout.write("%d %s %r\n" % (rid, status, payload))
+
+sock.close()